@@ -6,6 +6,7 @@
 #include <type_traits>
 #include <limits>
 #include <numeric>
+#include <memory>
 #include <algorithm>
 
 #include <misc/util/util.hpp>
@@ -19,20 +20,9 @@
 
 
 namespace wpp {
-	std::string intrinsic_assert(
-		wpp::node_t expr,
-		wpp::node_t a, wpp::node_t b,
-		const wpp::Position& pos,
-		wpp::Environment& env,
-		wpp::Arguments* args
-	) {
-		// auto& [base, functions, tree, warnings] = env;
-
+	std::string intrinsic_assert(const std::string& a, const std::string& b, const wpp::Position& pos) {
 		// Check if strings are equal.
-		const auto str_a = eval_ast(a, env, args);
-		const auto str_b = eval_ast(b, env, args);
-
-		if (str_a != str_b)
+		if (a != b)
 			throw wpp::Exception{
 				// pos, "assertion failed: ", reconstruct_source(node_id, tree)
 				pos, "assertion failed!"
@@ -42,18 +32,20 @@ namespace wpp {
 	}
 
 
-	std::string intrinsic_error(wpp::node_t expr, const wpp::Position& pos, wpp::Environment& env, wpp::Arguments* args) {
-		const auto msg = eval_ast(expr, env, args);
+	std::string intrinsic_error(const std::string& msg, const wpp::Position& pos) {
 		throw wpp::Exception{ pos, msg };
 		return "";
 	}
 
 
-	std::string intrinsic_file(wpp::node_t expr, const wpp::Position& pos, wpp::Environment& env, wpp::Arguments* args) {
-		const auto fname = eval_ast(expr, env, args);
-
+	std::string intrinsic_file(const std::string& fname, const wpp::Position& pos, wpp::Environment& env) {
 		try {
-			return wpp::read_file(std::filesystem::relative(std::filesystem::path{fname}).c_str());
+			const auto path = (env.cwd / fname).lexically_normal();
+
+			std::string str = wpp::read_file(path.c_str());
+			env.inputs.emplace_back(path);
+
+			return str;
 		}
 
 		catch (...) {
@@ -62,50 +54,135 @@ namespace wpp {
 	}
 
 
-	std::string intrinsic_source(wpp::node_t expr, const wpp::Position& pos, wpp::Environment& env, wpp::Arguments* args) {
-		const auto fname = eval_ast(expr, env, args);
+	// Evaluating `var` and `prefix` modifies the tree so code containing
+	// them can't be reused.
+	bool reusable(wpp::node_t first, const wpp::AST& tree) {
+		for (wpp::node_t i = first; i < tree.mark(); ++i) {
+			if (std::holds_alternative<Var>(tree[i]) or std::holds_alternative<Pre>(tree[i]))
+				return false;
+		}
+
+		return true;
+	}
+
+
+	std::pair<wpp::node_t, std::filesystem::path> parse_source(const std::string& fname, const wpp::Position& pos, wpp::Environment& env) {
+		auto& [once, modules] = env.sources;
+
+		// Get the path of the new file relative to the current directory.
+		const auto new_path = env.cwd / std::filesystem::path{fname};
+
+		// Modules are keyed by their canonical path so that the same file
+		// reached through different relative paths or links is only parsed once.
+		std::error_code ec;
+
+		const auto canonical = std::filesystem::weakly_canonical(new_path, ec);
+		const auto mtime = std::filesystem::last_write_time(new_path, ec);
+		const auto size = std::filesystem::file_size(new_path, ec);
+
+		if (ec)
+			throw wpp::Exception{pos, "file '", fname, "' not found."};
+
+		env.inputs.emplace_back(new_path.lexically_normal());
+
+		auto [it, inserted] = modules.try_emplace(canonical.native());
+		auto& module = it->second;
+
+		const bool changed = inserted or module.mtime != mtime or module.size != size;
+
+		if (not changed and once)
+			return { wpp::NODE_EMPTY, new_path };
+
+		if (not changed and module.root != wpp::NODE_EMPTY)
+			return { module.root, new_path };
+
+		// A file that hasn't changed is only read once, even if its tree has
+		// to be parsed again every time. Older versions of a file stay in
+		// the file table because nodes parsed from them may still be around.
+		const bool read = changed or not module.file;
+
+		if (read) {
+			wpp::Source file;
+
+			try {
+				file = wpp::Source::map(new_path.c_str());
+			}
+
+			catch (const std::filesystem::filesystem_error& e) {
+				modules.erase(it);
+				throw wpp::Exception{pos, "file '", fname, "' not found."};
+			}
+
+			// Register the file with its path relative to base path.
+			module.file = wpp::add_file(std::filesystem::relative(new_path, env.base), std::move(file));
+		}
 
-		// Store current path and get the path of the new file.
-		const auto old_path = std::filesystem::current_path();
-		const auto new_path = old_path / std::filesystem::path{fname};
+		const wpp::file_id_t file = *module.file;
+		wpp::Lexer lex{file};
 
-		// Read the new file.
-		std::string file;
+		const wpp::node_t mark = env.tree.mark();
+		wpp::node_t root = wpp::NODE_EMPTY;
 
 		try {
-			file = wpp::read_file(fname);
+			root = document(lex, env.tree);
 		}
 
-		catch (const std::filesystem::filesystem_error& e) {
-			throw wpp::Exception{pos, "file '", fname, "' not found."};
+		// Throw away whatever was parsed before the error. The file is
+		// kept because the error still refers to it.
+		catch (const wpp::Exception&) {
+			env.tree.release(mark);
+			modules.erase(it);
+			throw;
 		}
 
+		// Like eval, files containing `var` or `prefix` modify their own tree
+		// when evaluated so they have to be parsed again every time.
+		const bool reusable = wpp::reusable(mark, env.tree);
+
+		module = { reusable ? root : wpp::NODE_EMPTY, mtime, size, file };
 
-		// Create lexer, passing the new path relative to base path.
-		wpp::Lexer lex{std::filesystem::relative(new_path, env.base), file.c_str()};
-		wpp::node_t root = document(lex, env.tree);
+		if (reusable)
+			env.pinned = std::max(env.pinned, root);
 
+		return { root, new_path };
+	}
 
-		std::filesystem::current_path(new_path.parent_path());
 
-		const std::string str = wpp::eval_ast(root, env, args);
+	void intrinsic_source(const std::string& fname, const wpp::Position& pos, wpp::Environment& env, std::string& out, const wpp::Frame* frame) {
+		// Store current directory and parse the new file.
+		const auto old_path = env.cwd;
+		const wpp::node_t mark = env.tree.mark();
+		const auto [root, new_path] = parse_source(fname, pos, env);
 
-		std::filesystem::current_path(old_path);
+		// Already sourced with --source-once.
+		if (root == wpp::NODE_EMPTY)
+			return;
 
-		return str;
+		env.cwd = new_path.parent_path();
+
+		try {
+			wpp::eval_ast(root, env, out, frame);
+		}
+
+		catch (const wpp::Exception&) {
+			env.cwd = old_path;
+			throw;
+		}
+
+		env.cwd = old_path;
+		wpp::reclaim(mark, env);
 	}
 
 
-	std::string intrinsic_log(wpp::node_t expr, const wpp::Position&, wpp::Environment& env, wpp::Arguments* args) {
-		std::cerr << eval_ast(expr, env, args);
+	std::string intrinsic_log(const std::string& msg, wpp::Environment& env) {
+		*env.diagnostics << msg;
 		return "";
 	}
 
 
-	std::string intrinsic_escape(wpp::node_t expr, const wpp::Position&, wpp::Environment& env, wpp::Arguments* args) {
+	std::string intrinsic_escape(const std::string& input) {
 		// Escape escape chars in a string.
 		std::string str;
-		const auto input = eval_ast(expr, env, args);
 		str.reserve(input.size());
 
 		for (const char c: input) {
@@ -123,18 +200,11 @@ namespace wpp {
 	}
 
 	std::string intrinsic_slice(
-		wpp::node_t string_expr,
-		wpp::node_t start_expr,
-		wpp::node_t end_expr,
-		const wpp::Position& pos,
-		wpp::Environment& env,
-		wpp::Arguments* args
+		const std::string& string,
+		const std::string& start_raw,
+		const std::string& end_raw,
+		const wpp::Position& pos
 	) {
-		// Evaluate arguments
-		const auto string = eval_ast(string_expr, env, args);
-		const auto start_raw = eval_ast(start_expr, env, args);
-		const auto end_raw = eval_ast(end_expr, env, args);
-
 		// Parse the start and end arguments
 		int start;
 		int end;
@@ -179,16 +249,7 @@ namespace wpp {
 			return string.substr(begin, count);
 	}
 
-	std::string intrinsic_find(
-		wpp::node_t string_expr,
-		wpp::node_t pattern_expr,
-		wpp::Environment& env,
-		wpp::Arguments* args
-	) {
-		// Evaluate arguments
-		const auto string = eval_ast(string_expr, env, args);
-		const auto pattern = eval_ast(pattern_expr, env, args);
-
+	std::string intrinsic_find(const std::string& string, const std::string& pattern) {
 		// Search in string. Returns the index of a match.
 		if (auto position = string.find(pattern); position != std::string::npos)
 			return std::to_string(position);
@@ -196,366 +257,657 @@ namespace wpp {
 		return "";
 	}
 
-	std::string intrinsic_length(wpp::node_t string_expr, wpp::Environment& env, wpp::Arguments* args) {
-		// Evaluate argument
-		const auto string = eval_ast(string_expr, env, args);
+	std::string intrinsic_length(const std::string& string) {
 		return std::to_string(string.size());
 	}
 
-	std::string intrinsic_eval(wpp::node_t expr, const wpp::Position& pos, wpp::Environment& env, wpp::Arguments* args) {
-		auto& [base, functions, tree, warnings] = env;
+	wpp::node_t parse_eval(std::string code, const wpp::Position& pos, wpp::Environment& env) {
+		auto& [base, cwd, functions, tree, warnings, diagnostics, commands, jobs, inputs, sources, eval_cache, pinned, folded] = env;
+
+		// Generated code tends to repeat so we only parse each distinct string once.
+		if (const auto it = eval_cache.roots.find(code); it != eval_cache.roots.end())
+			return it->second;
 
-		const auto code = eval_ast(expr, env, args);
+		const uint64_t hash = wpp::hash_bytes(code.data(), code.data() + code.size());
+		uint64_t& slot = eval_cache.seen[hash & (wpp::EvalCache::SEEN_SLOTS - 1)];
+		const bool seen = slot == hash;
 
-		wpp::Lexer lex{"<eval>", code.c_str()};
-		wpp::node_t root;
+		const size_t length = code.size();
+		const wpp::file_id_t file = wpp::add_file("<eval>", std::move(code));
+
+		const wpp::node_t first = tree.mark();
+		wpp::Lexer lex{file};
+		wpp::node_t root = wpp::NODE_EMPTY;
 
 		try {
 			root = document(lex, tree);
-			return wpp::eval_ast(root, env, args);
 		}
 
 		catch (const wpp::Exception& e) {
+			tree.release(first);
+			wpp::release_file(file);
 			throw wpp::Exception{ pos, "inside eval: ", e.what() };
 		}
+
+		// The nodes of a document are contiguous so we only have to check
+		// the ones that were just added.
+		const bool reusable = wpp::reusable(first, tree);
+
+		// Code is only kept around once we've seen it twice so that one-off
+		// code can be reclaimed after it has been evaluated.
+		if (reusable and seen) {
+			eval_cache.roots.emplace(std::string_view{ wpp::file_contents(file), length }, root);
+			pinned = std::max(pinned, root);
+			slot = 0;
+			return root;
+		}
+
+		if (reusable)
+			slot = hash;
+
+		eval_cache.files.emplace_back(first, file);
+		return root;
 	}
 
+	void intrinsic_eval(std::string code, const wpp::Position& pos, wpp::Environment& env, std::string& out, const wpp::Frame* frame) {
+		const wpp::node_t mark = env.tree.mark();
+		const wpp::node_t root = parse_eval(std::move(code), pos, env);
 
-	std::string intrinsic_run(wpp::node_t expr, const wpp::Position& pos, wpp::Environment& env, wpp::Arguments* args) {
-		#if defined(WPP_DISABLE_RUN)
-			throw wpp::Exception{ pos, "run not available." };
-		#endif
+		try {
+			wpp::eval_ast(root, env, out, frame);
+			wpp::reclaim(mark, env);
+		}
+
+		catch (const wpp::Exception& e) {
+			throw wpp::Exception{ pos, "inside eval: ", e.what() };
+		}
+	}
 
-		const auto cmd = eval_ast(expr, env, args);
+
+	// Commands usually end their output with a newline which we don't want.
+	void trim_newline(std::string& str) {
+		if (not str.empty() and str.back() == '\n')
+			str.pop_back();
+	}
+
+
+	// Run a command, or get its result from the cache if there is one.
+	// `input` is only given for pipe.
+	std::string command(const std::string& cmd, const std::string* input, const wpp::Position& pos, const wpp::Environment& env) {
+		const auto& cmds = env.commands;
 
 		int rc = 0;
-		std::string str = wpp::exec(cmd, rc);
+		std::string out;
 
-		// trim trailing newline.
-		if (str.back() == '\n')
-			str.erase(str.end() - 1, str.end());
+		const bool cached = not cmds.cache.empty();
+		wpp::RunKey key;
+
+		if (cached)
+			key = wpp::run_key(cmd, input, env.cwd, cmds.salt);
+
+		if (not cached or not wpp::cache_load(cmds.cache, key, out, rc)) {
+			out = input ?
+				wpp::exec(cmd, *input, rc, cmds.direct, env.cwd):
+				wpp::exec(cmd, rc, cmds.direct, env.cwd);
+
+			// Only successes are cached, a command that failed may have
+			// failed because of something that will be fixed next time.
+			if (cached and rc == 0)
+				wpp::cache_store(cmds.cache, key, out, rc);
+		}
+
+		wpp::trim_newline(out);
 
 		if (rc)
 			throw wpp::Exception{ pos, "subprocess exited with non-zero status." };
 
-		return str;
+		return out;
+	}
+
+
+	std::string intrinsic_run(const std::string& cmd, const wpp::Position& pos, const wpp::Environment& env) {
+		#if defined(WPP_DISABLE_RUN)
+			throw wpp::Exception{ pos, "run not available." };
+		#endif
+
+		return wpp::command(cmd, nullptr, pos, env);
 	}
 
 
-	std::string intrinsic_pipe(wpp::node_t cmd, wpp::node_t data, const wpp::Position& pos, wpp::Environment& env, wpp::Arguments* args) {
+	std::string intrinsic_pipe(const std::string& cmd, const std::string& data, const wpp::Position& pos, const wpp::Environment& env) {
 		#if defined(WPP_DISABLE_RUN)
 			throw wpp::Exception{ pos, "pipe not available." };
 		#endif
 
-		std::string str;
+		return wpp::command(cmd, &data, pos, env);
+	}
 
-		const auto cmd_str = eval_ast(cmd, env, args);
-		const auto data_str = eval_ast(data, env, args);
 
-		int rc = 0;
-		std::string out = wpp::exec(cmd_str, data_str, rc);
+	std::string intrinsic(
+		wpp::token_type_t type,
+		const std::vector<std::string>& args,
+		const wpp::Position& pos,
+		wpp::Environment& env
+	) {
+		switch (type) {
+			case TOKEN_ASSERT: return wpp::intrinsic_assert(args[0], args[1], pos);
+			case TOKEN_ERROR:  return wpp::intrinsic_error(args[0], pos);
+			case TOKEN_FILE:   return wpp::intrinsic_file(args[0], pos, env);
+			case TOKEN_ESCAPE: return wpp::intrinsic_escape(args[0]);
+			case TOKEN_RUN:    return wpp::intrinsic_run(args[0], pos, env);
+			case TOKEN_PIPE:   return wpp::intrinsic_pipe(args[0], args[1], pos, env);
+			case TOKEN_SLICE:  return wpp::intrinsic_slice(args[0], args[1], args[2], pos);
+			case TOKEN_FIND:   return wpp::intrinsic_find(args[0], args[1]);
+			case TOKEN_LENGTH: return wpp::intrinsic_length(args[0]);
+			case TOKEN_LOG:    return wpp::intrinsic_log(args[0], env);
+		}
 
-		// trim trailing newline.
-		if (out.back() == '\n')
-			out.erase(out.end() - 1, out.end());
+		return "";
+	}
 
-		if (rc)
-			throw wpp::Exception{ pos, "subprocess exited with non-zero status." };
 
-		return out;
+
+
+	// Start a run or pipe in the background, leaving a hole in the sink
+	// where its output goes. At most `limit` commands run at once.
+	void defer(wpp::token_type_t type, const std::vector<std::string>& args, const wpp::Position& pos, wpp::Environment& env) {
+		#if defined(WPP_DISABLE_RUN)
+			*env.jobs.sink += wpp::intrinsic(type, args, pos, env);
+			return;
+		#endif
+
+		auto& [limit, sink, holes] = env.jobs;
+
+		std::vector<wpp::Process*> running;
+
+		while (true) {
+			running.clear();
+
+			for (wpp::Hole& hole: holes) {
+				if (hole.proc.running())
+					running.emplace_back(&hole.proc);
+
+				// Reap commands that have finished as we go so that they don't
+				// pile up as zombies.
+				else if (hole.proc.pid != -1)
+					wpp::wait(hole.proc);
+			}
+
+			if (running.size() < limit)
+				break;
+
+			wpp::pump(running);
+		}
+
+		const auto& cmds = env.commands;
+		const std::string* input = type == TOKEN_PIPE ? &args[1] : nullptr;
+
+		wpp::Hole hole{ sink->size(), {}, pos };
+
+		if (not cmds.cache.empty()) {
+			hole.key = wpp::run_key(args[0], input, env.cwd, cmds.salt);
+
+			// Nothing to run, the hole is filled in straight away.
+			if (wpp::cache_load(cmds.cache, *hole.key, hole.proc.output, hole.proc.rc)) {
+				hole.key.reset();
+				holes.emplace_back(std::move(hole));
+				return;
+			}
+		}
+
+		hole.proc = wpp::spawn(args[0], input, cmds.direct, env.cwd);
+		holes.emplace_back(std::move(hole));
 	}
 
 
+	void settle(wpp::Environment& env, size_t from) {
+		auto& [limit, sink, holes] = env.jobs;
 
+		if (from >= holes.size())
+			return;
 
+		// Keep every remaining command moving until they have all finished.
+		std::vector<wpp::Process*> running;
 
+		do {
+			running.clear();
 
+			for (size_t i = from; i < holes.size(); ++i)
+				if (holes[i].proc.running())
+					running.emplace_back(&holes[i].proc);
 
-	// The core of the evaluator.
-	std::string eval_ast(const wpp::node_t node_id, wpp::Environment& env, wpp::Arguments* args) {
-		const auto& variant = env.tree[node_id];
-		std::string str;
+			if (not running.empty())
+				wpp::pump(running);
+		} while (not running.empty());
 
-		wpp::visit(variant,
-			[&] (const Intrinsic& fn) {
-				const auto& [type, name, exprs, pos] = fn;
+		for (size_t i = from; i < holes.size(); ++i) {
+			auto& [offset, proc, pos, key, discard] = holes[i];
 
-				// Make sure that intrinsic is called with the correct number of arguments.
-				constexpr std::array intrinsic_arg_n = [&] {
-					std::array<size_t, TOKEN_TOTAL> lookup{};
-
-					lookup[TOKEN_SLICE]  = 3;
-					lookup[TOKEN_FIND]   = 2;
-					lookup[TOKEN_ASSERT] = 2;
-					lookup[TOKEN_PIPE]   = 2;
-					lookup[TOKEN_ERROR]  = 1;
-					lookup[TOKEN_FILE]   = 1;
-					lookup[TOKEN_ESCAPE] = 1;
-					lookup[TOKEN_EVAL]   = 1;
-					lookup[TOKEN_RUN]    = 1;
-					lookup[TOKEN_SOURCE] = 1;
-					lookup[TOKEN_LENGTH] = 1;
-					lookup[TOKEN_LOG]    = 1;
-
-					return lookup;
-				} ();
+			wpp::wait(proc);
 
+			if (key and proc.rc == 0)
+				wpp::cache_store(env.commands.cache, *key, proc.output, proc.rc);
+		}
 
-				const auto n_args = intrinsic_arg_n[type];
-				if (n_args != exprs.size())
-					throw wpp::Exception{pos, name, " takes exactly ", n_args, " arguments."};
+		// Report the first command that failed, in the order they were called.
+		for (size_t i = from; i < holes.size(); ++i) {
+			if (holes[i].proc.rc) {
+				const wpp::Position pos = holes[i].pos;
+				holes.erase(holes.begin() + from, holes.end());
 
+				throw wpp::Exception{ pos, "subprocess exited with non-zero status." };
+			}
+		}
 
-				// Dispatch to instrinsics.
-				if (type == TOKEN_ASSERT)
-					str = wpp::intrinsic_assert(node_id, exprs[0], exprs[1], pos, env, args);
+		// Rebuild the output from the first hole onwards.
+		const size_t begin = holes[from].offset;
+		size_t last = begin;
 
-				else if (type == TOKEN_ERROR)
-					str = wpp::intrinsic_error(exprs[0], pos, env, args);
+		std::string tail;
 
-				else if (type == TOKEN_FILE)
-					str = wpp::intrinsic_file(exprs[0], pos, env, args);
+		for (size_t i = from; i < holes.size(); ++i) {
+			auto& [offset, proc, pos, key, discard] = holes[i];
 
-				else if (type == TOKEN_SOURCE)
-					str = wpp::intrinsic_source(exprs[0], pos, env, args);
+			tail.append(*sink, last, offset - last);
+			last = offset;
 
-				else if (type == TOKEN_ESCAPE)
-					str = wpp::intrinsic_escape(exprs[0], pos, env, args);
+			if (not discard) {
+				wpp::trim_newline(proc.output);
+				tail += proc.output;
+			}
+		}
 
-				else if (type == TOKEN_EVAL)
-					str = wpp::intrinsic_eval(exprs[0], pos, env, args);
+		tail.append(*sink, last);
 
-				else if (type == TOKEN_RUN)
-					str = wpp::intrinsic_run(exprs[0], pos, env, args);
+		sink->resize(begin);
+		*sink += tail;
 
-				else if (type == TOKEN_PIPE)
-					str = wpp::intrinsic_pipe(exprs[0], exprs[1], pos, env, args);
+		holes.erase(holes.begin() + from, holes.end());
+	}
 
-				else if (type == TOKEN_SLICE)
-					str = wpp::intrinsic_slice(exprs[0], exprs[1], exprs[2], pos, env, args);
 
-				else if (type == TOKEN_FIND)
-					str = wpp::intrinsic_find(exprs[0], exprs[1], env, args);
+	Environment::Environment(const std::shared_ptr<const wpp::Snapshot>& snapshot, wpp::AST& tree_):
+		base(snapshot->base),
+		cwd(snapshot->cwd),
+		functions(snapshot->functions),
+		tree(tree_),
+		warning_flags(snapshot->warning_flags),
+		diagnostics(snapshot->diagnostics),
+		commands(snapshot->commands),
+		inputs(snapshot->inputs),
+		sources(snapshot->sources),
+		eval_cache(snapshot->eval_cache),
+		pinned(snapshot->pinned),
+		folded(snapshot->folded)
+	{
+		jobs.limit = snapshot->jobs;
+		tree = wpp::AST{ snapshot->nodes };
+	}
 
-				else if (type == TOKEN_LENGTH)
-					str = wpp::intrinsic_length(exprs[0], env, args);
 
-				else if (type == TOKEN_LOG)
-					str = wpp::intrinsic_log(exprs[0], pos, env, args);
-			},
+	std::shared_ptr<const wpp::Snapshot> Environment::snapshot() {
+		auto snapshot = std::make_shared<wpp::Snapshot>();
 
-			[&] (const FnInvoke& call) {
-				auto& [base, functions, tree, warnings] = env;
-				const auto& [caller_name, caller_args, caller_pos] = call;
-				std::string caller_mangled_name = wpp::cat(caller_name, caller_args.size());
+		snapshot->base = base;
+		snapshot->cwd = cwd;
 
-				// Check if parameter.
-				if (args) {
-					if (auto it = (*args).find(caller_name); it != (*args).end()) {
-						if (caller_args.size() > 0)
-							throw wpp::Exception{caller_pos, "calling argument '", caller_name, "' as if it were a function."};
+		snapshot->functions = functions.freeze();
+		snapshot->nodes = tree.freeze();
 
-						str = it->second;
+		snapshot->warning_flags = warning_flags;
+		snapshot->diagnostics = diagnostics;
 
-						// Check if it's shadowing a function (even this one).
-						if (warnings & wpp::WARN_PARAM_SHADOW_FUNC and functions.find(wpp::cat(caller_name, 0)) != functions.end())
-							wpp::warn(caller_pos, "parameter ", caller_name, " is shadowing a function.");
+		snapshot->commands = commands;
+		snapshot->jobs = jobs.limit;
 
-						return;
-					}
-				}
+		snapshot->inputs = inputs;
+		snapshot->sources = sources;
+		// Frozen nodes are never reclaimed so their files are kept for good.
+		eval_cache.files.clear();
+		snapshot->eval_cache = eval_cache;
+		snapshot->pinned = pinned;
+		snapshot->folded = folded;
 
-				// If it wasn't a parameter, we fall through to here and check if it's a function.
-				auto it = functions.find(caller_mangled_name);
-				if (it == functions.end())
-					throw wpp::Exception{caller_pos, "func not found: ", caller_name, "."};
+		return snapshot;
+	}
 
-				if (it->second.empty())
-					throw wpp::Exception{caller_pos, "func not found: ", caller_name, "."};
 
-				const auto func = tree.get<wpp::Fn>(it->second.back());
+	wpp::Environment Environment::fork(wpp::AST& tree_) {
+		return { snapshot(), tree_ };
+	}
 
-				// Retrieve function.
-				const auto& [callee_name, params, body, callee_pos] = func;
 
-				// Set up Arguments to pass down to function body.
-				Arguments env_args;
+	bool reclaim(wpp::node_t mark, wpp::Environment& env) {
+		if (env.pinned >= mark or env.tree.mark() == mark)
+			return false;
 
-				if (args) {
-					for (const auto& [key, val]: *args)
-						env_args.emplace(key, val);
-				}
+		env.tree.release(mark);
 
-				// Evaluate arguments and store their result.
-				for (int i = 0; i < (int)caller_args.size(); i++) {
-					const auto result = eval_ast(caller_args[i], env, args);
+		// Nothing refers to the code of an eval once its nodes are gone.
+		auto& files = env.eval_cache.files;
 
-					if (auto it = env_args.find(params[i]); it != env_args.end()) {
-						if (warnings & wpp::WARN_PARAM_SHADOW_PARAM)
-							wpp::warn(callee_pos, "parameter '", it->first, "' inside function '", callee_name, "' shadows parameter from parent scope.");
+		for (; not files.empty() and files.back().first >= mark; files.pop_back())
+			wpp::release_file(files.back().second);
 
-						it->second = result;
-					}
+		return true;
+	}
 
-					else {
-						env_args.insert_or_assign(params[i], eval_ast(caller_args[i], env, args));
-					}
-				}
 
-				// Call function.
-				str = eval_ast(body, env, &env_args);
-			},
+	const std::string* lookup_param(wpp::symbol_t name, const wpp::Frame* frame, const wpp::AST& tree) {
+		for (; frame; frame = frame->parent) {
+			const auto& params = tree.get<wpp::Fn>(frame->fn).parameters;
 
-			[&] (const Fn& func) {
-				auto& [base, functions, tree, warnings] = env;
-				const auto& [name, params, body, pos] = func;
+			// Later parameters shadow earlier ones with the same name.
+			for (size_t i = params.size(); i > 0; --i) {
+				if (params[i - 1] == name)
+					return &frame->args[i - 1];
+			}
+		}
 
-				auto it = functions.find(wpp::cat(name, params.size()));
+		return nullptr;
+	}
 
-				if (it != functions.end()) {
-					if (warnings & wpp::WARN_FUNC_REDEFINED)
-						wpp::warn(pos, "function '", name, "' redefined.");
 
-					it->second.emplace_back(node_id);
-				}
+	wpp::node_t lookup_fn(wpp::symbol_t name, size_t n_args, const wpp::Position& pos, wpp::Environment& env) {
+		const auto* defs = env.functions.find(name, n_args);
 
-				else
-					functions.emplace(wpp::cat(name, params.size()), std::vector{node_id});
-			},
+		if (not defs or defs->empty())
+			throw wpp::Exception{pos, "func not found: ", wpp::symbol_str(name), "."};
 
-			[&] (const Codeify& colby) {
-				const auto& [expr, pos] = colby;
-				str = intrinsic_eval(expr, pos, env, args);
-			},
+		return defs->back();
+	}
 
-			[&] (const Var& var) {
-				auto& [base, functions, tree, warnings] = env;
-				auto [name, body, pos] = var;
 
-				const auto func_name = wpp::cat(name, 0);
-				const auto str = eval_ast(body, env, args);
+	void define_fn(wpp::node_t node_id, wpp::Environment& env) {
+		auto& [base, cwd, functions, tree, warnings, diagnostics, commands, jobs, inputs, sources, eval_cache, pinned, folded] = env;
+		const auto& [name, params, body, pos] = tree.get<Fn>(node_id);
+
+		auto& defs = functions(name, params.size());
 
-				// Replace body with a string of the evaluation result.
-				tree.replace<String>(body, str, pos);
+		if (warnings & wpp::WARN_FUNC_REDEFINED and not defs.empty())
+			wpp::warn(*diagnostics, pos, "function '", wpp::symbol_str(name), "' redefined.");
 
-				// Replace Var node with Fn node.
-				tree.replace<Fn>(node_id, func_name, std::vector<std::string>{}, body, pos);
+		defs.emplace_back(node_id);
+		pinned = std::max(pinned, node_id);
+	}
 
-				auto it = functions.find(func_name);
-				if (it != functions.end()) {
-					if (warnings & wpp::WARN_VARFUNC_REDEFINED)
-						wpp::warn(tree.get<Fn>(node_id).pos, "function/variable '", name, "' redefined.");
 
-					it->second.emplace_back(node_id);
-				}
+	void fold_var(wpp::node_t node_id, const std::string& value, wpp::Environment& env) {
+		auto& [base, cwd, functions, tree, warnings, diagnostics, commands, jobs, inputs, sources, eval_cache, pinned, folded] = env;
+		auto [name, body, pos] = tree.get<Var>(node_id);
+
+		// Variables from a snapshot are folded into new nodes of our own
+		// which take their place from now on.
+		if (tree.shared(node_id) or tree.shared(body)) {
+			const wpp::node_t str = tree.add<String>(std::string{ value }, pos);
+			const wpp::node_t fn = tree.add<Fn>(name, std::vector<wpp::symbol_t>{}, str, pos);
+
+			folded[node_id] = fn;
+			node_id = fn;
+		}
+
+		else {
+			// Replace body with a string of the evaluation result.
+			tree.replace<String>(body, std::string{ value }, pos);
+
+			// Replace Var node with Fn node.
+			tree.replace<Fn>(node_id, name, std::vector<wpp::symbol_t>{}, body, pos);
+		}
+
+		auto& defs = functions(name, 0);
+
+		if (warnings & wpp::WARN_VARFUNC_REDEFINED and not defs.empty())
+			wpp::warn(*diagnostics, pos, "function/variable '", wpp::symbol_str(name), "' redefined.");
+
+		defs.emplace_back(node_id);
+		pinned = std::max(pinned, node_id);
+	}
+
+
+	void drop_fn(wpp::node_t node_id, wpp::Environment& env) {
+		auto& [base, cwd, functions, tree, warnings, diagnostics, commands, jobs, inputs, sources, eval_cache, pinned, folded] = env;
+		const auto& [func_id, pos] = tree.get<Drop>(node_id);
+
+		auto* func = std::get_if<FnInvoke>(&tree[func_id]);
+
+		if (not func)
+			throw wpp::Exception{pos, "invalid function passed to drop."};
+
+		const auto& [caller_name, caller_args, caller_slot, caller_pos] = *func;
+
+		if (not functions.defined(caller_name, caller_args.size()))
+			throw wpp::Exception{pos, "cannot drop undefined function '", wpp::symbol_str(caller_name), "' (", caller_args.size(), " parameters)."};
+
+		functions(caller_name, caller_args.size()).pop_back();
+	}
+
+
+
+
+	// The core of the evaluator.
+	// Output is appended to `out` rather than returned so that text is
+	// only ever written once, directly where it ends up.
+	void eval_ast(const wpp::node_t node_id, wpp::Environment& env, std::string& out, const wpp::Frame* frame) {
+		const auto& variant = env.tree[node_id];
+
+		wpp::visit(variant,
+			[&] (const Intrinsic& fn) {
+				const auto& [type, name, exprs, pos] = fn;
+
+				// Make sure that intrinsic is called with the correct number of arguments.
+				const auto n_args = intrinsic_arg_n[type];
+				if (n_args != exprs.size())
+					throw wpp::Exception{pos, name, " takes exactly ", n_args, " arguments."};
+
+				// Evaluate arguments.
+				std::vector<std::string> strings(exprs.size());
+
+				for (size_t i = 0; i < exprs.size(); ++i)
+					eval_ast(exprs[i], env, strings[i], frame);
+
+				// Dispatch to instrinsics.
+				if (type == TOKEN_SOURCE)
+					wpp::intrinsic_source(strings[0], pos, env, out, frame);
+
+				else if (type == TOKEN_EVAL)
+					wpp::intrinsic_eval(std::move(strings[0]), pos, env, out, frame);
+
+				// With -j, commands whose output goes straight to the document
+				// don't have to hold up evaluation.
+				else if ((type == TOKEN_RUN or type == TOKEN_PIPE) and env.jobs.limit > 1 and &out == env.jobs.sink)
+					wpp::defer(type, strings, pos, env);
 
 				else
-					functions.emplace(func_name, std::vector{node_id});
+					out += wpp::intrinsic(type, strings, pos, env);
 			},
 
-			[&] (const Drop& drop) {
-				auto& [base, functions, tree, warnings] = env;
-				const auto& [func_id, pos] = drop;
+			[&] (const FnInvoke& call) {
+				auto& [base, cwd, functions, tree, warnings, diagnostics, commands, jobs, inputs, sources, eval_cache, pinned, folded] = env;
+				const auto& [caller_name, caller_args, caller_slot, caller_pos] = call;
 
-				auto* func = std::get_if<FnInvoke>(&tree[func_id]);
+				// Check if parameter. If the parser was able to resolve it, the
+				// argument lives in our own frame.
+				const std::string* param = caller_slot != -1 ?
+					&frame->args[caller_slot]:
+					lookup_param(caller_name, frame, tree);
 
-				if (not func)
-					throw wpp::Exception{pos, "invalid function passed to drop."};
+				if (param) {
+					if (caller_args.size() > 0)
+						throw wpp::Exception{caller_pos, "calling argument '", wpp::symbol_str(caller_name), "' as if it were a function."};
 
-				const auto& [caller_name, caller_args, caller_pos] = *func;
+					out += *param;
 
-				std::string caller_mangled_name = wpp::cat(caller_name, caller_args.size());
+					// Check if it's shadowing a function (even this one).
+					if (warnings & wpp::WARN_PARAM_SHADOW_FUNC and functions.defined(caller_name, 0))
+						wpp::warn(*diagnostics, caller_pos, "parameter ", wpp::symbol_str(caller_name), " is shadowing a function.");
 
-				auto it = functions.find(caller_mangled_name);
+					return;
+				}
 
-				if (it != functions.end()) {
-					if (not it->second.empty())
-						it->second.pop_back();
+				// If it wasn't a parameter, we fall through to here and check if it's a function.
+				const wpp::node_t func = lookup_fn(caller_name, caller_args.size(), caller_pos, env);
 
-					else
-						functions.erase(it);
-				}
+				// Set up a frame to pass down to the function body and
+				// evaluate arguments into it.
+				wpp::Frame callee{ func, std::vector<std::string>(caller_args.size()), frame };
 
-				else {
-					throw wpp::Exception{pos, "cannot drop undefined function '", caller_name, "' (", caller_args.size(), " parameters)."};
+				for (size_t i = 0; i < caller_args.size(); ++i)
+					eval_ast(caller_args[i], env, callee.args[i], frame);
+
+				// Retrieve function.
+				const auto& [callee_name, params, body, callee_pos] = tree.get<wpp::Fn>(func);
+
+				if (warnings & wpp::WARN_PARAM_SHADOW_PARAM) {
+					for (const auto& param: params) {
+						if (lookup_param(param, frame, tree))
+							wpp::warn(*diagnostics, callee_pos, "parameter '", wpp::symbol_str(param), "' inside function '", wpp::symbol_str(callee_name), "' shadows parameter from parent scope.");
+					}
 				}
+
+				// Call function.
+				eval_ast(body, env, out, &callee);
+			},
+
+			[&] (const Fn&) {
+				define_fn(node_id, env);
+			},
+
+			[&] (const Codeify& colby) {
+				const auto& [expr, pos] = colby;
+				intrinsic_eval(eval_ast(expr, env, frame), pos, env, out, frame);
+			},
+
+			[&] (const Var& var) {
+				if (const auto it = env.folded.find(node_id); it != env.folded.end())
+					define_fn(it->second, env);
+
+				else
+					fold_var(node_id, eval_ast(var.body, env, frame), env);
+			},
+
+			[&] (const Drop&) {
+				drop_fn(node_id, env);
 			},
 
 			[&] (const String& x) {
-				str = x.value;
+				out += x.value;
 			},
 
 			[&] (const Concat& cat) {
 				const auto& [lhs, rhs, pos] = cat;
-				str = eval_ast(lhs, env, args) + eval_ast(rhs, env, args);
+
+				eval_ast(lhs, env, out, frame);
+				eval_ast(rhs, env, out, frame);
 			},
 
 			[&] (const Block& block) {
 				const auto& [stmts, expr, pos] = block;
 
+				// Statements are evaluated for their side effects only so we
+				// throw away whatever they wrote.
+				const size_t mark = out.size();
+				const size_t holes = env.jobs.holes.size();
+
 				for (const wpp::node_t node: stmts)
-					str += eval_ast(node, env, args);
+					eval_ast(node, env, out, frame);
+
+				out.resize(mark);
 
-				str = eval_ast(expr, env, args);
+				// Background commands started by the statements still have to
+				// finish but their output goes the same way.
+				for (size_t i = holes; i < env.jobs.holes.size(); ++i) {
+					env.jobs.holes[i].offset = mark;
+					env.jobs.holes[i].discard = true;
+				}
+
+				eval_ast(expr, env, out, frame);
 			},
 
 			[&] (const Map& map) {
-				const auto& [test, cases, default_case, pos] = map;
+				const auto& [test, cases, default_case, index, pos] = map;
 
-				const auto test_str = eval_ast(test, env, args);
+				const auto test_str = eval_ast(test, env, frame);
 
-				// Compare test_str with arms of the map.
-				auto it = std::find_if(cases.begin(), cases.end(), [&] (const auto& elem) {
-					return test_str == eval_ast(elem.first, env, args);
-				});
+				// Find the hand of the first arm that matches.
+				wpp::node_t hand = default_case;
 
-				// If found, evaluate the hand.
-				if (it != cases.end())
-					str = eval_ast(it->second, env, args);
+				if (index) {
+					if (auto it = index->find(test_str); it != index->end())
+						hand = cases[it->second].second;
+				}
 
-				// If not found, check for a default arm, otherwise error.
 				else {
-					if (default_case == wpp::NODE_EMPTY)
-						throw wpp::Exception{pos, "no matches found."};
+					// Compare test_str with arms of the map.
+					// The same buffer is reused for every arm.
+					std::string arm_str;
+
+					auto it = std::find_if(cases.begin(), cases.end(), [&] (const auto& elem) {
+						arm_str.clear();
+						eval_ast(elem.first, env, arm_str, frame);
 
-					else
-						str = eval_ast(default_case, env, args);
+						return test_str == arm_str;
+					});
+
+					if (it != cases.end())
+						hand = it->second;
 				}
+
+				// If nothing matched and there's no default arm, error.
+				if (hand == wpp::NODE_EMPTY)
+					throw wpp::Exception{pos, "no matches found."};
+
+				eval_ast(hand, env, out, frame);
 			},
 
 			[&] (const Pre& pre) {
-				auto& [base, functions, tree, warnings] = env;
-				const auto& [exprs, stmts, pos] = pre;
+				auto& [base, cwd, functions, tree, warnings, diagnostics, commands, jobs, inputs, sources, eval_cache, pinned, folded] = env;
+				// Copied because adding nodes below can move the tree.
+				const auto [exprs, stmts, pos] = pre;
 
+				// Nodes from a snapshot are copied before being changed.
 				for (const wpp::node_t stmt: stmts) {
-					if (wpp::Fn* func = std::get_if<wpp::Fn>(&tree[stmt])) {
+					if (std::holds_alternative<wpp::Fn>(tree[stmt])) {
 						std::string name;
 
 						for (auto it = exprs.rbegin(); it != exprs.rend(); ++it)
-							name += eval_ast(*it, env, args);
+							eval_ast(*it, env, name, frame);
+
+						const wpp::node_t fn = tree.shared(stmt) ?
+							tree.add<wpp::Fn>(tree.get<wpp::Fn>(stmt)) : stmt;
 
-						func->identifier = name + func->identifier;
-						str += eval_ast(stmt, env, args);
+						auto& func = tree.get_mut<wpp::Fn>(fn);
+
+						func.identifier = wpp::intern(name + wpp::symbol_str(func.identifier));
+						eval_ast(fn, env, out, frame);
 					}
 
-					else if (wpp::Pre* pre = std::get_if<wpp::Pre>(&tree[stmt])) {
-						pre->exprs.insert(pre->exprs.end(), exprs.begin(), exprs.end());
-						str += eval_ast(stmt, env, args);
+					else if (std::holds_alternative<wpp::Pre>(tree[stmt])) {
+						const wpp::node_t nested = tree.shared(stmt) ?
+							tree.add<wpp::Pre>(tree.get<wpp::Pre>(stmt)) : stmt;
+
+						auto& pre = tree.get_mut<wpp::Pre>(nested);
+
+						pre.exprs.insert(pre.exprs.end(), exprs.begin(), exprs.end());
+						eval_ast(nested, env, out, frame);
 					}
 
 					else {
-						str += eval_ast(stmt, env, args);
+						eval_ast(stmt, env, out, frame);
 					}
 				}
 			},
 
 			[&] (const Document& doc) {
 				for (const wpp::node_t node: doc.stmts)
-					str += eval_ast(node, env, args);
+					eval_ast(node, env, out, frame);
 			}
 		);
+	}
 
+
+	std::string eval_ast(const wpp::node_t node_id, wpp::Environment& env, const wpp::Frame* frame) {
+		std::string str;
+		eval_ast(node_id, env, str, frame);
 		return str;
 	}
 }
-
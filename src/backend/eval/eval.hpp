@@ -4,69 +4,273 @@
 #define WOTPP_EVAL
 
 #include <string>
+#include <string_view>
 #include <vector>
+#include <array>
+#include <utility>
 #include <unordered_map>
 #include <filesystem>
+#include <optional>
+#include <memory>
 
+#include <misc/warnings.hpp>
+#include <misc/util/util.hpp>
+#include <misc/run_cache/run_cache.hpp>
+#include <structures/symbol.hpp>
+#include <structures/fn_table.hpp>
+#include <frontend/lexer/lexer.hpp>
 #include <frontend/parser/ast_nodes.hpp>
 
 // AST visitor that evaluates the program.
 
 namespace wpp {
-	using Arguments = std::unordered_map<std::string, std::string>;
+	// Every function call gets a frame holding its evaluated arguments.
+	// Frames are linked to the frame of their caller and parameters which
+	// can't be resolved ahead of time are found by walking up the chain,
+	// which gives us dynamic scoping without copying arguments around.
+	struct Frame {
+		wpp::node_t fn = wpp::NODE_EMPTY;  // The Fn whose parameters name the slots.
+		std::vector<std::string> args{};
+		const Frame* parent = nullptr;
+	};
+
+	// How run and pipe execute commands.
+	struct Commands {
+		bool direct = false;  // Execute commands without shell syntax without the shell.
+		std::filesystem::path cache{};  // Directory of cached results, empty if disabled.
+		std::string salt{};  // Mixed into every cache key.
+	};
+
+
+	// A run or pipe whose output will be inserted at `offset` of the output
+	// once the command finishes.
+	struct Hole {
+		size_t offset;
+		wpp::Process proc;
+		wpp::Position pos;
+		std::optional<wpp::RunKey> key{};  // Set if the result should be cached.
+		bool discard = false;  // The output was thrown away by a block.
+	};
+
+	// With a limit above 1, run and pipe calls whose output goes straight
+	// into `sink` are started in the background and leave a hole behind.
+	// Everything else still runs the command and waits for it.
+	struct Jobs {
+		size_t limit = 1;
+		std::string* sink = nullptr;
+		std::vector<wpp::Hole> holes{};
+	};
+
+
+	// A file that has been sourced. The root is kept so that sourcing the
+	// file again doesn't have to read or parse it, as long as it hasn't changed.
+	// Trees that can't be reused are parsed again from the same file.
+	struct Module {
+		wpp::node_t root = wpp::NODE_EMPTY;  // NODE_EMPTY if the tree can't be reused.
+		std::filesystem::file_time_type mtime{};
+		uintmax_t size = 0;
+		std::optional<wpp::file_id_t> file{};  // Unset until the file has been read.
+	};
+
+	// Modules keyed by canonical path. With `once`, sourcing a file that
+	// has already been sourced does nothing.
+	struct Sources {
+		bool once = false;
+		std::unordered_map<std::string, wpp::Module> modules{};
+	};
+
+
+	// Code passed to `eval`. Roots are only kept once the same code has
+	// been seen twice, the code seen once is remembered by hash in a fixed
+	// number of slots so that one-off code doesn't take up space forever.
+	struct EvalCache {
+		static constexpr size_t SEEN_SLOTS = 1 << 12;
+
+		// Keyed by the code itself, the views point into the file table.
+		std::unordered_map<std::string_view, wpp::node_t> roots{};
+		std::vector<uint64_t> seen = std::vector<uint64_t>(SEEN_SLOTS);
+
+		// Files added for code whose nodes haven't been kept, along with
+		// the mark they were parsed at. They are released along with their
+		// nodes by `reclaim`.
+		std::vector<std::pair<wpp::node_t, wpp::file_id_t>> files{};
+	};
+
+
+	struct Snapshot;
+
 
 	struct Environment {
 		std::filesystem::path base;
-		std::unordered_map<std::string, std::vector<wpp::node_t>> functions{};
+
+		// Directory that relative paths given to `source`, `file`, `run`
+		// and `pipe` are resolved against. The process working directory
+		// is never changed so that environments can be used from several
+		// threads at once.
+		std::filesystem::path cwd;
+
+		wpp::FnTable functions{};
 		wpp::AST& tree;
 		wpp::warning_t warning_flags = 0;
 
+		// Where warnings and the output of `log` are written. Nothing else
+		// in an environment touches global state so each thread can have
+		// its own environment and sink.
+		std::ostream* diagnostics = &std::cerr;
+
+		wpp::Commands commands{};
+
+		wpp::Jobs jobs{};
+
+		// Absolute paths of every file read by `source` or `file`.
+		std::vector<std::filesystem::path> inputs{};
+
+		wpp::Sources sources{};
+
+		wpp::EvalCache eval_cache{};
+
+		// Highest node that something outside of the tree refers to, i.e. a
+		// defined function or a cached eval root. Nodes above it can be reclaimed.
+		wpp::node_t pinned = wpp::NODE_EMPTY;
+
+		// Variables that belong to a snapshot can't be folded in place, the
+		// functions they were folded into by this environment are kept here.
+		std::unordered_map<wpp::node_t, wpp::node_t> folded{};
+
 		Environment(
 			const std::filesystem::path& base_,
 			wpp::AST& tree_,
 			const wpp::warning_t warning_flags_ = 0
 		):
 			base(base_),
+			cwd(base_),
 			tree(tree_),
 			warning_flags(warning_flags_) {}
+
+		// Start an environment on top of a snapshot, `tree_` is replaced
+		// by a tree that shares the nodes of the snapshot.
+		Environment(const std::shared_ptr<const wpp::Snapshot>& snapshot, wpp::AST& tree_);
+
+		// Freeze the tree and everything defined so far so that it can be
+		// shared by forks. We carry on working on top of the snapshot.
+		// Only the snapshot itself may be used from other threads.
+		std::shared_ptr<const wpp::Snapshot> snapshot();
+
+		// Snapshot ourselves and start a new environment on top of it.
+		// Definitions made by either of them afterwards don't affect the other.
+		wpp::Environment fork(wpp::AST& tree_);
 	};
 
 
-	std::string intrinsic_assert(
-		wpp::node_t expr,
-		wpp::node_t a, wpp::node_t b,
-		const wpp::Position& pos,
-		wpp::Environment& env,
-		wpp::Arguments* args = nullptr
-	);
+	// Everything an environment had defined when `snapshot` was called.
+	// The nodes and functions are shared with every environment started
+	// from it, the rest is copied.
+	struct Snapshot {
+		std::filesystem::path base;
+		std::filesystem::path cwd;
+
+		std::shared_ptr<const wpp::FnTable> functions;
+		std::shared_ptr<const wpp::AST::Nodes> nodes;
+
+		wpp::warning_t warning_flags = 0;
+		std::ostream* diagnostics = &std::cerr;
+
+		wpp::Commands commands{};
+		size_t jobs = 1;
+
+		std::vector<std::filesystem::path> inputs{};
+		wpp::Sources sources{};
+		wpp::EvalCache eval_cache{};
+		wpp::node_t pinned = wpp::NODE_EMPTY;
+		std::unordered_map<wpp::node_t, wpp::node_t> folded{};
+	};
+
+
+	// Number of arguments each intrinsic takes.
+	constexpr std::array intrinsic_arg_n = [] {
+		std::array<size_t, TOKEN_TOTAL> lookup{};
+
+		lookup[TOKEN_SLICE]  = 3;
+		lookup[TOKEN_FIND]   = 2;
+		lookup[TOKEN_ASSERT] = 2;
+		lookup[TOKEN_PIPE]   = 2;
+		lookup[TOKEN_ERROR]  = 1;
+		lookup[TOKEN_FILE]   = 1;
+		lookup[TOKEN_ESCAPE] = 1;
+		lookup[TOKEN_EVAL]   = 1;
+		lookup[TOKEN_RUN]    = 1;
+		lookup[TOKEN_SOURCE] = 1;
+		lookup[TOKEN_LENGTH] = 1;
+		lookup[TOKEN_LOG]    = 1;
+
+		return lookup;
+	} ();
+
+
+	// Intrinsics operate on already evaluated arguments so that they can be
+	// shared between the tree walker and the VM.
+	std::string intrinsic_assert(const std::string& a, const std::string& b, const wpp::Position& pos);
+	std::string intrinsic_error(const std::string& msg, const wpp::Position& pos);
+	std::string intrinsic_file(const std::string& fname, const wpp::Position& pos, wpp::Environment& env);
+	std::string intrinsic_log(const std::string& msg, wpp::Environment& env);
+	std::string intrinsic_escape(const std::string& input);
+	std::string intrinsic_length(const std::string& string);
+	std::string intrinsic_find(const std::string& string, const std::string& pattern);
+	std::string intrinsic_run(const std::string& cmd, const wpp::Position& pos, const wpp::Environment& env);
+	std::string intrinsic_pipe(const std::string& cmd, const std::string& data, const wpp::Position& pos, const wpp::Environment& env);
 
 	std::string intrinsic_slice(
-		wpp::node_t string_expr,
-		wpp::node_t start_expr,
-		wpp::node_t end_expr,
-		const wpp::Position& pos,
-		wpp::Environment& env,
-		wpp::Arguments* args = nullptr
+		const std::string& string,
+		const std::string& start_raw,
+		const std::string& end_raw,
+		const wpp::Position& pos
 	);
 
-	std::string intrinsic_find(
-		wpp::node_t string_expr,
-		wpp::node_t pattern_expr,
-		wpp::Environment& env,
-		wpp::Arguments* args = nullptr
+	// Dispatch any intrinsic other than `eval` and `source` which need
+	// to evaluate code themselves.
+	std::string intrinsic(
+		wpp::token_type_t type,
+		const std::vector<std::string>& args,
+		const wpp::Position& pos,
+		wpp::Environment& env
 	);
 
-	std::string eval_ast(const wpp::node_t, wpp::Environment&, wpp::Arguments* = nullptr);
-	std::string intrinsic_error(wpp::node_t expr, const wpp::Position& pos, wpp::Environment& env, wpp::Arguments* args = nullptr);
-	std::string intrinsic_file(wpp::node_t expr, const wpp::Position& pos, wpp::Environment& env, wpp::Arguments* args = nullptr);
-	std::string intrinsic_source(wpp::node_t expr, const wpp::Position& pos, wpp::Environment& env, wpp::Arguments* args = nullptr);
-	std::string intrinsic_log(wpp::node_t expr, const wpp::Position&, wpp::Environment& env, wpp::Arguments* args = nullptr);
-	std::string intrinsic_escape(wpp::node_t expr, const wpp::Position&, wpp::Environment& env, wpp::Arguments* args = nullptr);
-	std::string intrinsic_length(wpp::node_t string_expr, wpp::Environment& env, wpp::Arguments* args);
-	std::string intrinsic_eval(wpp::node_t expr, const wpp::Position& pos, wpp::Environment& env, wpp::Arguments* args = nullptr);
-	std::string intrinsic_run(wpp::node_t expr, const wpp::Position& pos, wpp::Environment& env, wpp::Arguments* args = nullptr);
-	std::string intrinsic_pipe(wpp::node_t cmd, wpp::node_t data, const wpp::Position& pos, wpp::Environment& env, wpp::Arguments* args = nullptr);
+	// Parse code passed to `eval` or a file passed to `source` into the tree.
+	// `source` also returns the path of the file so the caller can change
+	// into its directory while evaluating it, or NODE_EMPTY if the file
+	// shouldn't be evaluated again because of --source-once.
+	wpp::node_t parse_eval(std::string code, const wpp::Position& pos, wpp::Environment& env);
+	std::pair<wpp::node_t, std::filesystem::path> parse_source(const std::string& fname, const wpp::Position& pos, wpp::Environment& env);
+
+
+	// Wait for the background commands of holes `from` onwards and fill
+	// in their output. The first one that failed is thrown in order.
+	void settle(wpp::Environment& env, size_t from = 0);
+
+
+	// Find a parameter by name, starting at `frame` and walking up to the root.
+	const std::string* lookup_param(wpp::symbol_t name, const wpp::Frame* frame, const wpp::AST& tree);
+
+
+	// Free the nodes added to the tree since `mark` if none of them are
+	// pinned. Returns whether anything was freed.
+	bool reclaim(wpp::node_t mark, wpp::Environment& env);
+
+
+	// Function table helpers.
+	wpp::node_t lookup_fn(wpp::symbol_t name, size_t n_args, const wpp::Position& pos, wpp::Environment& env);
+	void define_fn(wpp::node_t node_id, wpp::Environment& env);
+	void fold_var(wpp::node_t node_id, const std::string& value, wpp::Environment& env);
+	void drop_fn(wpp::node_t node_id, wpp::Environment& env);
+
+
+	// Evaluate a node, appending its output to `out`.
+	void eval_ast(const wpp::node_t, wpp::Environment&, std::string& out, const wpp::Frame* = nullptr);
+	void intrinsic_eval(std::string code, const wpp::Position& pos, wpp::Environment& env, std::string& out, const wpp::Frame* frame = nullptr);
+	void intrinsic_source(const std::string& fname, const wpp::Position& pos, wpp::Environment& env, std::string& out, const wpp::Frame* frame = nullptr);
+
+	// Evaluate a node into a new string.
+	std::string eval_ast(const wpp::node_t, wpp::Environment&, const wpp::Frame* = nullptr);
 }
 
 #endif
-
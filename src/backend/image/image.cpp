@@ -0,0 +1,674 @@
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <system_error>
+#include <memory>
+#include <utility>
+#include <limits>
+#include <tuple>
+#include <variant>
+#include <type_traits>
+
+#include <cstdint>
+#include <cstring>
+
+#include <misc/util/util.hpp>
+#include <frontend/position.hpp>
+#include <frontend/parser/parser.hpp>
+#include <frontend/parser/ast_nodes.hpp>
+#include <structures/symbol.hpp>
+#include <structures/fn_table.hpp>
+
+#include <backend/image/image.hpp>
+
+
+namespace wpp {
+	// An image is a header, followed by a stream of 32 bit words describing
+	// everything and then a blob holding the bytes of every string and file.
+	// Strings are stored as an offset into the blob and a length.
+	// Bump the version if the layout of the words or of the nodes changes.
+	// Images are trusted like the code they were made from. References are
+	// checked so that a truncated image can't take us out of bounds and the
+	// checksum catches anything else that was damaged, but nothing stops a
+	// deliberately crafted image from making the evaluator misbehave.
+	constexpr char image_magic[8] = { 'w', 'p', 'p', 'i', 'm', 'a', 'g', 'e' };
+	constexpr uint32_t image_version = 1;
+	constexpr uint32_t image_order = 0x01020304;  // Catches images from machines with a different byte order.
+
+	constexpr size_t image_header = sizeof(image_magic) + 4 + 4 + 8 + 8 + 8;
+
+
+	namespace {
+		// Node kinds are their index in the variant.
+		template <typename T, typename... Ts>
+		constexpr uint32_t kind_of(const std::variant<Ts...>*) {
+			uint32_t i = 0;
+			(void)((std::is_same_v<T, Ts> ? true : (++i, false)) or ...);
+			return i;
+		}
+
+		template <typename T>
+		constexpr uint32_t kind = kind_of<T>(static_cast<const wpp::AST::value_type*>(nullptr));
+
+
+		struct Writer {
+			std::vector<uint32_t> words{};
+			std::string blob{};
+
+			// Files and symbols are numbered in the order we first see them.
+			// File 0 is "no file", like in the file table.
+			std::unordered_map<wpp::file_id_t, uint32_t> file_index{};
+			std::vector<std::pair<wpp::file_id_t, uint32_t>> files{};  // ID and offset in the blob.
+
+			std::unordered_map<wpp::symbol_t, uint32_t> symbol_index{};
+			std::vector<wpp::symbol_t> symbols{};
+
+
+			void word(uint32_t x) {
+				words.emplace_back(x);
+			}
+
+			void u64(uint64_t x) {
+				word(x & 0xFFFFFFFF);
+				word(x >> 32);
+			}
+
+			uint32_t append(std::string_view str) {
+				const size_t offset = blob.size();
+				blob += str;
+				return offset;
+			}
+
+			void str(std::string_view s) {
+				word(append(s));
+				word(s.size());
+			}
+
+			uint32_t file(wpp::file_id_t file) {
+				if (file == 0)
+					return 0;
+
+				const auto [it, inserted] = file_index.try_emplace(file, files.size() + 1);
+
+				if (inserted) {
+					files.emplace_back(file, append(wpp::file_view(file)));
+					blob.append(wpp::FILE_PADDING, '\0');
+				}
+
+				return it->second;
+			}
+
+			void symbol(wpp::symbol_t sym) {
+				const auto [it, inserted] = symbol_index.try_emplace(sym, symbols.size());
+
+				if (inserted)
+					symbols.emplace_back(sym);
+
+				word(it->second);
+			}
+
+			void node(wpp::node_t node) {
+				word(static_cast<uint32_t>(node));
+			}
+
+			void nodes(const std::vector<wpp::node_t>& v) {
+				word(v.size());
+
+				for (const wpp::node_t x: v)
+					node(x);
+			}
+
+			void pos(const wpp::Position& pos) {
+				word(file(pos.file));
+				word(pos.offset);
+			}
+
+			// Literals that were parsed straight out of a file point into it
+			// so they don't need to be copied again.
+			void string(std::string_view value, const wpp::Position& pos) {
+				if (pos.file != 0) {
+					const auto contents = wpp::file_view(pos.file);
+
+					if (value.data() >= contents.data() and value.data() + value.size() <= contents.data() + contents.size()) {
+						const uint32_t offset = files[file(pos.file) - 1].second;
+
+						word(offset + (value.data() - contents.data()));
+						word(value.size());
+
+						return;
+					}
+				}
+
+				str(value);
+			}
+		};
+
+
+		struct Reader {
+			const std::filesystem::path& path;
+
+			const char* words;
+			size_t n_words;
+			size_t at = 0;
+
+			const char* blob;
+			size_t blob_size;
+
+			std::vector<wpp::file_id_t> files{ 0 };
+			std::vector<wpp::symbol_t> symbols{};
+			size_t n_nodes = 0;
+
+
+			[[noreturn]] void fail() const {
+				throw std::runtime_error{ wpp::cat("'", path.string(), "' is damaged.") };
+			}
+
+			void expect(bool cond) const {
+				if (not cond)
+					fail();
+			}
+
+			uint32_t word() {
+				expect(at < n_words);
+
+				uint32_t x;
+				std::memcpy(&x, words + at++ * 4, 4);
+
+				return x;
+			}
+
+			uint64_t u64() {
+				const uint64_t lo = word();
+				return lo | (static_cast<uint64_t>(word()) << 32);
+			}
+
+			std::string_view str() {
+				const uint64_t offset = word(), size = word();
+				expect(offset + size <= blob_size);
+
+				return { blob + offset, size };
+			}
+
+			wpp::file_id_t file() {
+				const uint32_t i = word();
+				expect(i < files.size());
+
+				return files[i];
+			}
+
+			wpp::symbol_t symbol() {
+				const uint32_t i = word();
+				expect(i < symbols.size());
+
+				return symbols[i];
+			}
+
+			wpp::node_t node() {
+				const auto x = static_cast<wpp::node_t>(word());
+				expect(x == wpp::NODE_EMPTY or (x >= 0 and static_cast<size_t>(x) < n_nodes));
+
+				return x;
+			}
+
+			// A count of things that each take up at least one word.
+			uint32_t count() {
+				const uint32_t n = word();
+				expect(n <= n_words - at);
+
+				return n;
+			}
+
+			std::vector<wpp::node_t> nodes() {
+				std::vector<wpp::node_t> v(count());
+
+				for (wpp::node_t& x: v)
+					x = node();
+
+				return v;
+			}
+
+			wpp::Position pos() {
+				const wpp::file_id_t f = file();
+				return { f, word() };
+			}
+		};
+
+
+		// Paths are stored relative to the base of the snapshot.
+		std::string relative_path(const std::filesystem::path& path, const std::filesystem::path& base) {
+			const auto rel = path.lexically_relative(base);
+			return rel.empty() ? path.string() : rel.string();
+		}
+	}
+
+
+	void dump_image(const wpp::Snapshot& snapshot, const std::filesystem::path& path) {
+		const auto& tree = *snapshot.nodes;
+
+		Writer w;
+
+		w.word(tree.size());
+
+		for (const auto& variant: tree) {
+			wpp::visit(variant,
+				[&] (const FnInvoke& call) {
+					w.word(kind<FnInvoke>);
+					w.pos(call.pos);
+					w.symbol(call.identifier);
+					w.nodes(call.arguments);
+					w.word(static_cast<uint32_t>(call.slot));
+				},
+
+				[&] (const Intrinsic& fn) {
+					w.word(kind<Intrinsic>);
+					w.pos(fn.pos);
+					w.word(fn.type);
+					w.str(fn.identifier);
+					w.nodes(fn.arguments);
+				},
+
+				[&] (const Fn& func) {
+					w.word(kind<Fn>);
+					w.pos(func.pos);
+					w.symbol(func.identifier);
+					w.word(func.parameters.size());
+
+					for (const wpp::symbol_t param: func.parameters)
+						w.symbol(param);
+
+					w.node(func.body);
+				},
+
+				[&] (const Var& var) {
+					w.word(kind<Var>);
+					w.pos(var.pos);
+					w.symbol(var.identifier);
+					w.node(var.body);
+				},
+
+				[&] (const Codeify& code) {
+					w.word(kind<Codeify>);
+					w.pos(code.pos);
+					w.node(code.expr);
+				},
+
+				// The index is rebuilt when the image is loaded.
+				[&] (const Map& map) {
+					w.word(kind<Map>);
+					w.pos(map.pos);
+					w.node(map.expr);
+					w.word(map.cases.size());
+
+					for (const auto& [arm, result]: map.cases) {
+						w.node(arm);
+						w.node(result);
+					}
+
+					w.node(map.default_case);
+				},
+
+				[&] (const String& str) {
+					w.word(kind<String>);
+					w.pos(str.pos);
+					w.string(str.value, str.pos);
+				},
+
+				[&] (const Concat& cat) {
+					w.word(kind<Concat>);
+					w.pos(cat.pos);
+					w.node(cat.lhs);
+					w.node(cat.rhs);
+				},
+
+				[&] (const Block& block) {
+					w.word(kind<Block>);
+					w.pos(block.pos);
+					w.nodes(block.statements);
+					w.node(block.expr);
+				},
+
+				[&] (const Pre& pre) {
+					w.word(kind<Pre>);
+					w.pos(pre.pos);
+					w.nodes(pre.exprs);
+					w.nodes(pre.statements);
+				},
+
+				[&] (const Document& doc) {
+					w.word(kind<Document>);
+					w.pos(doc.pos);
+					w.nodes(doc.stmts);
+				},
+
+				[&] (const Drop& drop) {
+					w.word(kind<Drop>);
+					w.pos(drop.pos);
+					w.node(drop.func);
+				}
+			);
+		}
+
+		// Functions that have been dropped entirely aren't worth keeping.
+		std::vector<std::tuple<wpp::symbol_t, size_t, const std::vector<wpp::node_t>*>> functions;
+
+		snapshot.functions->each([&] (wpp::symbol_t sym, size_t arity, const std::vector<wpp::node_t>& defs) {
+			if (not defs.empty())
+				functions.emplace_back(sym, arity, &defs);
+		});
+
+		w.word(functions.size());
+
+		for (const auto& [sym, arity, defs]: functions) {
+			w.symbol(sym);
+			w.word(arity);
+			w.nodes(*defs);
+		}
+
+		w.word(snapshot.folded.size());
+
+		for (const auto& [var, fn]: snapshot.folded) {
+			w.node(var);
+			w.node(fn);
+		}
+
+		w.node(snapshot.pinned);
+
+		w.word(snapshot.inputs.size());
+
+		for (const auto& input: snapshot.inputs)
+			w.str(relative_path(input, snapshot.base));
+
+		w.word(snapshot.sources.modules.size());
+
+		for (const auto& [key, module]: snapshot.sources.modules) {
+			w.str(relative_path(key, snapshot.base));
+			w.node(module.root);
+			w.u64(static_cast<int64_t>(module.mtime.time_since_epoch().count()));
+			w.u64(module.size);
+		}
+
+		// Files and symbols come first so that they can be registered
+		// before the nodes that refer to them are read.
+		std::vector<uint32_t> body;
+		std::swap(w.words, body);
+
+		w.word(w.files.size());
+
+		for (const auto& [file, offset]: w.files) {
+			w.str(wpp::file_path(file));
+			w.word(offset);
+			w.word(wpp::file_view(file).size());
+		}
+
+		w.word(w.symbols.size());
+
+		for (const wpp::symbol_t sym: w.symbols)
+			w.str(wpp::symbol_str(sym));
+
+		w.words.insert(w.words.end(), body.begin(), body.end());
+
+		if (w.blob.size() > std::numeric_limits<uint32_t>::max())
+			throw std::filesystem::filesystem_error{
+				"image is too large", path, std::make_error_code(std::errc::file_too_large)
+			};
+
+		// Write to a temporary file and rename it into place so that a
+		// running build never maps a partially written image.
+		auto tmp = path;
+		tmp += ".tmp";
+
+		{
+			std::ofstream os{ tmp, std::ios::binary };
+
+			const uint64_t n_words = w.words.size();
+			const uint64_t blob_size = w.blob.size();
+
+			const auto* words = reinterpret_cast<const char*>(w.words.data());
+			const uint64_t checksum = wpp::hash_bytes(words, words + n_words * 4) ^ wpp::hash_bytes(w.blob.data(), w.blob.data() + blob_size);
+
+			os.write(image_magic, sizeof(image_magic));
+			os.write(reinterpret_cast<const char*>(&image_version), 4);
+			os.write(reinterpret_cast<const char*>(&image_order), 4);
+			os.write(reinterpret_cast<const char*>(&n_words), 8);
+			os.write(reinterpret_cast<const char*>(&blob_size), 8);
+			os.write(reinterpret_cast<const char*>(&checksum), 8);
+			os.write(words, n_words * 4);
+			os.write(w.blob.data(), blob_size);
+
+			if (not os.flush()) {
+				os.close();
+
+				std::error_code ec;
+				std::filesystem::remove(tmp, ec);
+
+				throw std::filesystem::filesystem_error{
+					"cannot write image", path, std::make_error_code(std::errc::io_error)
+				};
+			}
+		}
+
+		std::filesystem::rename(tmp, path);
+	}
+
+
+	std::shared_ptr<const wpp::Snapshot> load_image(const std::filesystem::path& path, const std::filesystem::path& base) {
+		wpp::Source source = wpp::Source::map(path.string());
+		const size_t size = source.size();
+
+		// The file table keeps the image mapped for the rest of the program
+		// because the files and strings we register point into it.
+		const wpp::file_id_t image = wpp::add_file(path.string(), std::move(source));
+		const char* const data = wpp::file_contents(image);
+
+		std::vector<wpp::file_id_t> added{ image };
+
+		try {
+			if (size < image_header or std::memcmp(data, image_magic, sizeof(image_magic)) != 0)
+				throw std::runtime_error{ wpp::cat("'", path.string(), "' is not a wot++ image.") };
+
+			uint32_t version, order;
+			uint64_t n_words, blob_size, checksum;
+
+			std::memcpy(&version, data + 8, 4);
+			std::memcpy(&order, data + 12, 4);
+			std::memcpy(&n_words, data + 16, 8);
+			std::memcpy(&blob_size, data + 24, 8);
+			std::memcpy(&checksum, data + 32, 8);
+
+			if (version != image_version or order != image_order)
+				throw std::runtime_error{ wpp::cat("'", path.string(), "' was made by a different version of wot++.") };
+
+			Reader r{ path, data + image_header, n_words, 0, nullptr, blob_size };
+
+			r.expect(n_words <= (size - image_header) / 4 and image_header + n_words * 4 + blob_size == size);
+			r.blob = data + image_header + n_words * 4;
+
+			r.expect(checksum == (wpp::hash_bytes(r.words, r.blob) ^ wpp::hash_bytes(r.blob, r.blob + blob_size)));
+
+			// Register the sources of the nodes, they borrow from the image.
+			const uint32_t n_files = r.count();
+
+			for (uint32_t i = 0; i < n_files; ++i) {
+				const auto name = r.str();
+				const uint64_t offset = r.word(), length = r.word();
+
+				r.expect(offset + length + wpp::FILE_PADDING <= blob_size);
+
+				const auto file = wpp::add_file(std::string{name}, wpp::Source::borrow({ r.blob + offset, length }));
+
+				added.emplace_back(file);
+				r.files.emplace_back(file);
+			}
+
+			const uint32_t n_symbols = r.count();
+
+			for (uint32_t i = 0; i < n_symbols; ++i)
+				r.symbols.emplace_back(wpp::intern(r.str()));
+
+			// Nodes are added in order so that they keep their indices.
+			r.n_nodes = r.count();
+
+			wpp::AST tree;
+			tree.reserve(r.n_nodes);
+
+			std::vector<wpp::node_t> maps;
+
+			for (size_t i = 0; i < r.n_nodes; ++i) {
+				const uint32_t k = r.word();
+				const wpp::Position pos = r.pos();
+
+				if (k == kind<FnInvoke>) {
+					const wpp::symbol_t name = r.symbol();
+					const auto args = r.nodes();
+
+					const wpp::node_t node = tree.add<FnInvoke>(name, args, pos);
+					tree.get_mut<FnInvoke>(node).slot = static_cast<int32_t>(r.word());
+				}
+
+				else if (k == kind<Intrinsic>) {
+					const uint32_t type = r.word();
+					r.expect(type < TOKEN_TOTAL);
+
+					const std::string name{ r.str() };
+					tree.add<Intrinsic>(static_cast<wpp::token_type_t>(type), name, r.nodes(), pos);
+				}
+
+				else if (k == kind<Fn>) {
+					const wpp::symbol_t name = r.symbol();
+					std::vector<wpp::symbol_t> params(r.count());
+
+					for (wpp::symbol_t& param: params)
+						param = r.symbol();
+
+					tree.add<Fn>(name, params, r.node(), pos);
+				}
+
+				else if (k == kind<Var>) {
+					const wpp::symbol_t name = r.symbol();
+					tree.add<Var>(name, r.node(), pos);
+				}
+
+				else if (k == kind<Codeify>)
+					tree.add<Codeify>(r.node(), pos);
+
+				else if (k == kind<Map>) {
+					const wpp::node_t expr = r.node();
+					std::vector<std::pair<wpp::node_t, wpp::node_t>> cases(r.count());
+
+					for (auto& [arm, result]: cases) {
+						arm = r.node();
+						result = r.node();
+					}
+
+					maps.emplace_back(tree.add<Map>(expr, cases, r.node(), pos));
+				}
+
+				else if (k == kind<String>)
+					tree.add<String>(r.str(), pos);
+
+				else if (k == kind<Concat>) {
+					const wpp::node_t lhs = r.node();
+					tree.add<Concat>(lhs, r.node(), pos);
+				}
+
+				else if (k == kind<Block>) {
+					const auto stmts = r.nodes();
+					tree.add<Block>(stmts, r.node(), pos);
+				}
+
+				else if (k == kind<Pre>) {
+					const auto exprs = r.nodes();
+					tree.add<Pre>(exprs, r.nodes(), pos);
+				}
+
+				else if (k == kind<Document>)
+					tree.add<Document>(r.nodes(), pos);
+
+				else if (k == kind<Drop>)
+					tree.add<Drop>(r.node(), pos);
+
+				else
+					r.fail();
+			}
+
+			for (const wpp::node_t map: maps)
+				wpp::index_map(map, tree);
+
+			const auto is = [&] (auto type, wpp::node_t node) {
+				return node != wpp::NODE_EMPTY and std::holds_alternative<decltype(type)>(tree[node]);
+			};
+
+			wpp::FnTable functions;
+			const uint32_t n_functions = r.count();
+
+			for (uint32_t i = 0; i < n_functions; ++i) {
+				const wpp::symbol_t name = r.symbol();
+				const uint32_t arity = r.word();
+
+				auto defs = r.nodes();
+
+				for (const wpp::node_t def: defs)
+					r.expect(is(Fn{}, def));
+
+				functions(name, arity) = std::move(defs);
+			}
+
+			auto snapshot = std::make_shared<wpp::Snapshot>();
+
+			const uint32_t n_folded = r.count();
+
+			for (uint32_t i = 0; i < n_folded; ++i) {
+				const wpp::node_t var = r.node(), fn = r.node();
+				r.expect(is(Var{}, var) and is(Fn{}, fn));
+
+				snapshot->folded.emplace(var, fn);
+			}
+
+			snapshot->pinned = r.node();
+
+			const uint32_t n_inputs = r.count();
+
+			for (uint32_t i = 0; i < n_inputs; ++i)
+				snapshot->inputs.emplace_back((base / r.str()).lexically_normal());
+
+			// Anything rendered on top of the image depends on the image too.
+			snapshot->inputs.emplace_back(std::filesystem::absolute(path).lexically_normal());
+
+			const uint32_t n_modules = r.count();
+
+			for (uint32_t i = 0; i < n_modules; ++i) {
+				const auto key = (base / r.str()).lexically_normal().string();
+
+				wpp::Module module;
+
+				module.root = r.node();
+				module.mtime = std::filesystem::file_time_type{
+					std::filesystem::file_time_type::duration{ static_cast<int64_t>(r.u64()) }
+				};
+				module.size = r.u64();
+
+				snapshot->sources.modules.emplace(key, module);
+			}
+
+			r.expect(r.at == n_words);
+
+			snapshot->base = base;
+			snapshot->cwd = base;
+			snapshot->functions = functions.freeze();
+			snapshot->nodes = tree.freeze();
+
+			return snapshot;
+		}
+
+		catch (const std::runtime_error&) {
+			for (const wpp::file_id_t file: added)
+				wpp::release_file(file);
+
+			throw;
+		}
+	}
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#ifndef WOTPP_IMAGE
+#define WOTPP_IMAGE
+
+#include <memory>
+#include <filesystem>
+
+#include <backend/eval/eval.hpp>
+
+// Environment images.
+// A snapshot is written out with every node, function and folded variable
+// along with the source files its nodes came from. Nothing in an image is
+// a pointer so it can be written on one machine and used on another with
+// the same version of wot++.
+// Loading an image maps it into memory and adds it to the file table,
+// string literals and sources then point straight into the mapping so
+// only the nodes themselves have to be rebuilt.
+
+namespace wpp {
+	// Write a snapshot to `path`. Paths are stored relative to the
+	// snapshot's base so that the image can be moved.
+	// Throws std::filesystem::filesystem_error if it can't be written.
+	void dump_image(const wpp::Snapshot& snapshot, const std::filesystem::path& path);
+
+	// Map an image and rebuild the snapshot it was made from on top of `base`.
+	// Throws std::filesystem::filesystem_error if it can't be read or
+	// std::runtime_error if it isn't an image made by this version.
+	std::shared_ptr<const wpp::Snapshot> load_image(const std::filesystem::path& path, const std::filesystem::path& base);
+}
+
+#endif
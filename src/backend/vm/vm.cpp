@@ -0,0 +1,618 @@
+#include <string>
+#include <vector>
+#include <iterator>
+#include <utility>
+#include <algorithm>
+#include <filesystem>
+
+#include <misc/util/util.hpp>
+#include <misc/warnings.hpp>
+#include <structures/exception.hpp>
+#include <frontend/parser/parser.hpp>
+#include <frontend/parser/ast_nodes.hpp>
+#include <backend/eval/eval.hpp>
+
+#include <backend/vm/vm.hpp>
+
+
+namespace wpp {
+	// Every node has a position member.
+	wpp::Position position_of(wpp::node_t node_id, const wpp::AST& tree) {
+		return std::visit([] (const auto& node) { return node.pos; }, tree[node_id]);
+	}
+
+
+	size_t VM::compile(wpp::node_t node_id) {
+		if (chunks.size() < env.tree.size())
+			chunks.resize(env.tree.size(), -1);
+
+		if (chunks[node_id] != -1)
+			return chunks[node_id];
+
+		const size_t offset = code.size();
+
+		expression(node_id);
+		emit(OP_RET);
+
+		chunks[node_id] = offset;
+		compiled.emplace_back(node_id);
+
+		return offset;
+	}
+
+
+	void VM::expression(wpp::node_t node_id) {
+		const int n = statement(node_id);
+
+		// Statements that don't produce a value evaluate to an empty string.
+		if (n != 1)
+			emit(OP_FLAT, n);
+	}
+
+
+	int VM::prefix(const std::vector<wpp::node_t>& exprs, const std::vector<wpp::node_t>& stmts) {
+		auto& tree = env.tree;
+		int n = 0;
+
+		for (const wpp::node_t stmt: stmts) {
+			if (std::holds_alternative<wpp::Fn>(tree[stmt])) {
+				for (auto it = exprs.rbegin(); it != exprs.rend(); ++it)
+					expression(*it);
+
+				emit(OP_FLAT, exprs.size());
+				emit(OP_DEFP, stmt);
+			}
+
+			// Nested prefixes inherit our prefix expressions.
+			else if (const wpp::Pre* pre = std::get_if<wpp::Pre>(&tree[stmt])) {
+				std::vector<wpp::node_t> nested = pre->exprs;
+				nested.insert(nested.end(), exprs.begin(), exprs.end());
+
+				emit(OP_FLAT, prefix(nested, pre->statements));
+				n++;
+			}
+
+			else
+				n += statement(stmt);
+		}
+
+		return n;
+	}
+
+
+	int VM::statement(wpp::node_t node_id) {
+		auto& tree = env.tree;
+		int n = 1;
+
+		wpp::visit(tree[node_id],
+			[&] (const Intrinsic& fn) {
+				const auto& [type, name, exprs, pos] = fn;
+
+				// Arity is checked by `invk` at runtime so that the error is raised
+				// at the same point as it would be in the tree walker. In that
+				// case we don't evaluate the arguments at all.
+				if (intrinsic_arg_n[type] != exprs.size()) {
+					emit(OP_INVK, node_id, 0);
+					return;
+				}
+
+				for (const wpp::node_t expr: exprs)
+					expression(expr);
+
+				if (type == TOKEN_EVAL)
+					emit(OP_EXEC, node_id);
+
+				else if (type == TOKEN_SOURCE)
+					emit(OP_SRC, node_id);
+
+				else
+					emit(OP_INVK, node_id, exprs.size());
+			},
+
+			[&] (const FnInvoke& call) {
+				// Like the tree walker, the function has to exist before
+				// any of its arguments are evaluated.
+				if (not call.arguments.empty())
+					emit(OP_FIND, node_id);
+
+				for (const wpp::node_t arg: call.arguments)
+					expression(arg);
+
+				emit(OP_JSR, node_id, call.arguments.size());
+			},
+
+			[&] (const Fn&) {
+				emit(OP_DEF, node_id);
+				n = 0;
+			},
+
+			[&] (const Codeify& colby) {
+				expression(colby.expr);
+				emit(OP_EXEC, node_id);
+			},
+
+			[&] (const Var& var) {
+				// If the variable has already been folded (i.e. we are inside of a
+				// function that has been called before), skip evaluating the body.
+				const size_t skip = emit(OP_VAR, node_id);
+
+				expression(var.body);
+				emit(OP_FOLD, node_id);
+
+				code[skip].b = code.size();
+				n = 0;
+			},
+
+			[&] (const Drop&) {
+				emit(OP_UNDEF, node_id);
+				n = 0;
+			},
+
+			[&] (const String& x) {
+				constants.emplace_back(x.value);
+				emit(OP_PUSH, constants.size() - 1);
+			},
+
+			[&] (const Concat&) {
+				// Flatten chains of concatenations so we only need a single `flat`.
+				std::vector<wpp::node_t> operands;
+				std::vector<wpp::node_t> pending{ node_id };
+
+				while (not pending.empty()) {
+					const wpp::node_t x = pending.back();
+					pending.pop_back();
+
+					if (const wpp::Concat* cat = std::get_if<wpp::Concat>(&tree[x])) {
+						pending.emplace_back(cat->rhs);
+						pending.emplace_back(cat->lhs);
+					}
+
+					else
+						operands.emplace_back(x);
+				}
+
+				for (const wpp::node_t x: operands)
+					expression(x);
+
+				emit(OP_FLAT, operands.size());
+			},
+
+			[&] (const Block& block) {
+				const auto& [stmts, expr, pos] = block;
+
+				// Statements are evaluated for their side effects only.
+				for (const wpp::node_t stmt: stmts) {
+					for (int i = statement(stmt); i > 0; --i)
+						emit(OP_DROP);
+				}
+
+				expression(expr);
+			},
+
+			[&] (const Map& map) {
+				const auto& [test, cases, default_case, index, pos] = map;
+
+				expression(test);
+
+				std::vector<size_t> exits;
+
+				// Constant maps jump straight to the matching hand. The table
+				// holds a jump for every arm and is followed by the default.
+				if (index) {
+					emit(OP_TABLE, node_id);
+
+					const size_t table = code.size();
+
+					for (size_t i = 0; i < cases.size(); ++i)
+						emit(OP_JMP);
+
+					if (default_case == wpp::NODE_EMPTY)
+						emit(OP_FAIL, node_id);
+
+					else {
+						expression(default_case);
+						exits.emplace_back(emit(OP_JMP));
+					}
+
+					for (size_t i = 0; i < cases.size(); ++i) {
+						code[table + i].a = code.size();
+
+						expression(cases[i].second);
+						exits.emplace_back(emit(OP_JMP));
+					}
+
+					for (const size_t exit: exits)
+						code[exit].a = code.size();
+
+					return;
+				}
+
+				for (const auto& [arm, hand]: cases) {
+					expression(arm);
+					const size_t next = emit(OP_MATCH);
+
+					expression(hand);
+					exits.emplace_back(emit(OP_JMP));
+
+					code[next].a = code.size();
+				}
+
+				if (default_case == wpp::NODE_EMPTY)
+					emit(OP_FAIL, node_id);
+
+				else {
+					emit(OP_DROP);  // Discard test string.
+					expression(default_case);
+				}
+
+				for (const size_t exit: exits)
+					code[exit].a = code.size();
+			},
+
+			[&] (const Pre& pre) {
+				emit(OP_FLAT, prefix(pre.exprs, pre.statements));
+			},
+
+			[&] (const Document& doc) {
+				int count = 0;
+
+				for (const wpp::node_t stmt: doc.stmts)
+					count += statement(stmt);
+
+				emit(OP_FLAT, count);
+			}
+		);
+
+		return n;
+	}
+
+
+
+
+	const std::string* VM::parameter(wpp::symbol_t name) const {
+		const auto& tree = env.tree;
+
+		for (auto it = frames.rbegin(); it != frames.rend(); ++it) {
+			if (it->kind != FRAME_CALL)
+				continue;
+
+			const auto& params = tree.get<wpp::Fn>(it->node).parameters;
+
+			// Later parameters shadow earlier ones with the same name.
+			for (size_t i = params.size(); i > 0; --i) {
+				if (params[i - 1] == name)
+					return &stack[it->base + i - 1];
+			}
+		}
+
+		return nullptr;
+	}
+
+
+	void VM::reclaim(const wpp::Region& region) {
+		if (not wpp::reclaim(region.nodes, env))
+			return;
+
+		// Compiled chunks are indexed by node so forget the ones we just freed.
+		if (chunks.size() > static_cast<size_t>(region.nodes))
+			chunks.resize(region.nodes);
+
+		// The code itself can only be freed if it all belongs to the region, an
+		// older node may have been compiled for the first time in the meantime.
+		const bool owned = std::all_of(compiled.begin() + region.compiled, compiled.end(), [&] (wpp::node_t node) {
+			return node >= region.nodes;
+		});
+
+		if (owned) {
+			code.resize(region.code);
+			constants.resize(region.constants);
+			compiled.resize(region.compiled);
+		}
+	}
+
+
+	size_t VM::call(size_t pc, size_t chunk, size_t base, wpp::node_t node, uint8_t kind) {
+		frames.push_back({ pc, base, node, kind });
+		return chunk;
+	}
+
+
+	void VM::execute(size_t pc) {
+		auto& [base, cwd, functions, tree, warnings, diagnostics, commands, jobs, inputs, sources, eval_cache, pinned, folded] = env;
+
+		while (true) {
+			// Copy the instruction because compiling a chunk can reallocate `code`.
+			const auto [op, a, b] = code[pc];
+
+			switch (op) {
+				case OP_PUSH: {
+					stack.emplace_back(constants[a]);
+					pc++;
+				} break;
+
+				case OP_FLAT: {
+					if (a == 0)
+						stack.emplace_back();
+
+					else if (a > 1) {
+						const size_t first = stack.size() - a;
+						size_t length = 0;
+
+						for (size_t i = first; i != stack.size(); ++i)
+							length += stack[i].size();
+
+						std::string& str = stack[first];
+						str.reserve(length);
+
+						for (size_t i = first + 1; i != stack.size(); ++i)
+							str += stack[i];
+
+						stack.resize(first + 1);
+					}
+
+					pc++;
+				} break;
+
+				case OP_DROP: {
+					stack.pop_back();
+					pc++;
+				} break;
+
+				case OP_FIND: {
+					const auto& [caller_name, caller_args, caller_slot, caller_pos] = tree.get<wpp::FnInvoke>(a);
+
+					if (caller_slot != -1 or parameter(caller_name))
+						throw wpp::Exception{caller_pos, "calling argument '", wpp::symbol_str(caller_name), "' as if it were a function."};
+
+					callees.emplace_back(lookup_fn(caller_name, caller_args.size(), caller_pos, env));
+					pc++;
+				} break;
+
+				case OP_JSR: {
+					const auto& [caller_name, caller_args, caller_slot, caller_pos] = tree.get<wpp::FnInvoke>(a);
+
+					wpp::node_t func = wpp::NODE_EMPTY;
+
+					// Calls with arguments were resolved by `find`, anything
+					// else might be a parameter.
+					if (b > 0) {
+						func = callees.back();
+						callees.pop_back();
+					}
+
+					else {
+						// Resolved parameters always belong to the innermost
+						// frame because eval and source code is never resolved.
+						const std::string* value = caller_slot != -1 ?
+							&stack[frames.back().base + caller_slot]:
+							parameter(caller_name);
+
+						if (value) {
+							// Check if it's shadowing a function (even this one).
+							if (warnings & wpp::WARN_PARAM_SHADOW_FUNC and functions.defined(caller_name, 0))
+								wpp::warn(*diagnostics, caller_pos, "parameter ", wpp::symbol_str(caller_name), " is shadowing a function.");
+
+							std::string str = *value;  // Copy before pushing as `value` points into the stack.
+							stack.emplace_back(std::move(str));
+
+							pc++;
+							break;
+						}
+
+						func = lookup_fn(caller_name, 0, caller_pos, env);
+					}
+
+					const auto& [callee_name, params, body, callee_pos] = tree.get<wpp::Fn>(func);
+
+					if (warnings & wpp::WARN_PARAM_SHADOW_PARAM) {
+						for (const auto& param: params) {
+							if (parameter(param))
+								wpp::warn(*diagnostics, callee_pos, "parameter '", wpp::symbol_str(param), "' inside function '", wpp::symbol_str(callee_name), "' shadows parameter from parent scope.");
+						}
+					}
+
+					pc = call(pc + 1, compile(body), stack.size() - b, func, FRAME_CALL);
+				} break;
+
+				case OP_RET: {
+					const auto frame = std::move(frames.back());
+					frames.pop_back();
+
+					// Remove arguments below the result.
+					std::string str = std::move(stack.back());
+					stack.resize(frame.base);
+					stack.emplace_back(std::move(str));
+
+					if (frame.kind == FRAME_SOURCE)
+						cwd = std::move(frame.path);
+
+					if (frame.kind == FRAME_ROOT)
+						return;
+
+					if (frame.kind == FRAME_EVAL or frame.kind == FRAME_SOURCE) {
+						reclaim(regions.back());
+						regions.pop_back();
+					}
+
+					pc = frame.ret;
+				} break;
+
+				case OP_INVK: {
+					const auto& [type, name, exprs, pos] = tree.get<wpp::Intrinsic>(a);
+
+					// Make sure that intrinsic is called with the correct number of arguments.
+					const auto n_args = intrinsic_arg_n[type];
+					if (n_args != exprs.size())
+						throw wpp::Exception{pos, name, " takes exactly ", n_args, " arguments."};
+
+					std::vector<std::string> args{
+						std::make_move_iterator(stack.end() - b),
+						std::make_move_iterator(stack.end())
+					};
+
+					stack.resize(stack.size() - b);
+					stack.emplace_back(wpp::intrinsic(type, args, pos, env));
+
+					pc++;
+				} break;
+
+				case OP_EXEC: {
+					std::string str = std::move(stack.back());
+					stack.pop_back();
+
+					regions.emplace_back(region());
+					const wpp::node_t root = parse_eval(std::move(str), position_of(a, tree), env);
+
+					pc = call(pc + 1, compile(root), stack.size(), a, FRAME_EVAL);
+				} break;
+
+				case OP_SRC: {
+					const std::string fname = std::move(stack.back());
+					stack.pop_back();
+
+					auto old_path = cwd;
+
+					const wpp::Region before = region();
+					const auto [root, new_path] = parse_source(fname, position_of(a, tree), env);
+
+					// Already sourced with --source-once.
+					if (root == wpp::NODE_EMPTY) {
+						stack.emplace_back();
+						pc++;
+						break;
+					}
+
+					regions.emplace_back(before);
+					cwd = new_path.parent_path();
+
+					pc = call(pc + 1, compile(root), stack.size(), a, FRAME_SOURCE);
+					frames.back().path = std::move(old_path);
+				} break;
+
+				case OP_DEF: {
+					define_fn(a, env);
+					pc++;
+				} break;
+
+				case OP_DEFP: {
+					// Functions from a snapshot are copied before being renamed.
+					const wpp::node_t fn = tree.shared(a) ?
+						tree.add<wpp::Fn>(tree.get<wpp::Fn>(a)) : a;
+
+					auto& func = tree.get_mut<wpp::Fn>(fn);
+					func.identifier = wpp::intern(stack.back() + wpp::symbol_str(func.identifier));
+					stack.pop_back();
+
+					define_fn(fn, env);
+					pc++;
+				} break;
+
+				case OP_VAR: {
+					// Already folded, it's just a function now.
+					if (std::holds_alternative<wpp::Fn>(tree[a])) {
+						define_fn(a, env);
+						pc = b;
+					}
+
+					else if (const auto it = folded.find(a); it != folded.end()) {
+						define_fn(it->second, env);
+						pc = b;
+					}
+
+					else
+						pc++;
+				} break;
+
+				case OP_FOLD: {
+					fold_var(a, stack.back(), env);
+					stack.pop_back();
+					pc++;
+				} break;
+
+				case OP_UNDEF: {
+					drop_fn(a, env);
+					pc++;
+				} break;
+
+				case OP_MATCH: {
+					const std::string arm = std::move(stack.back());
+					stack.pop_back();
+
+					// Matched, pop the test string and fall through to the hand.
+					if (arm == stack.back()) {
+						stack.pop_back();
+						pc++;
+					}
+
+					else
+						pc = a;
+				} break;
+
+				case OP_TABLE: {
+					const auto& [test, cases, default_case, index, pos] = tree.get<wpp::Map>(a);
+
+					const std::string str = std::move(stack.back());
+					stack.pop_back();
+
+					// Skip over the table to the default arm if nothing matched.
+					const auto it = index->find(str);
+					pc += 1 + (it == index->end() ? cases.size() : it->second);
+				} break;
+
+				case OP_JMP: {
+					pc = a;
+				} break;
+
+				case OP_FAIL: {
+					throw wpp::Exception{tree.get<wpp::Map>(a).pos, "no matches found."};
+				} break;
+			}
+		}
+	}
+
+
+	std::string VM::run(wpp::node_t root) {
+		stack.clear();
+		frames.clear();
+		regions.clear();
+		callees.clear();
+
+		try {
+			const size_t chunk = compile(root);
+
+			frames.push_back({ 0, 0, wpp::NODE_EMPTY, FRAME_ROOT });
+			execute(chunk);
+		}
+
+		catch (const wpp::Exception& e) {
+			// Errors raised inside of eval are wrapped once for every level of
+			// eval they pass through, just like the tree walker does.
+			wpp::Exception err = e;
+
+			for (auto it = frames.rbegin(); it != frames.rend(); ++it) {
+				if (it->kind == FRAME_EVAL)
+					err = wpp::Exception{ position_of(it->node, env.tree), "inside eval: ", err.what() };
+			}
+
+			// Go back to the directory we were in before the outermost source.
+			const auto it = std::find_if(frames.begin(), frames.end(), [] (const auto& frame) {
+				return frame.kind == FRAME_SOURCE;
+			});
+
+			if (it != frames.end())
+				env.cwd = it->path;
+
+			stack.clear();
+			frames.clear();
+			regions.clear();
+			callees.clear();
+
+			throw err;
+		}
+
+		std::string str = std::move(stack.back());
+		stack.clear();
+
+		return str;
+	}
+}
@@ -0,0 +1,158 @@
+#pragma once
+
+#ifndef WOTPP_VM
+#define WOTPP_VM
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <filesystem>
+
+#include <cstdint>
+
+#include <frontend/parser/ast_nodes.hpp>
+#include <backend/eval/eval.hpp>
+
+// Bytecode compiler and stack machine.
+// An alternative backend to the tree walker which lowers the AST into a flat
+// instruction stream. See `docs/history/vm` for the original sketch.
+
+namespace wpp {
+	using opcode_t = uint8_t;
+
+	// Like the token types, we use a macro here so that we can create
+	// both an enum of opcodes and an array of their names.
+	#define OPCODE_TYPES \
+		OPCODE(OP_PUSH)  /* push constant `a` */ \
+		OPCODE(OP_FLAT)  /* cat the top `a` strings on the stack */ \
+		OPCODE(OP_DROP)  /* remove the top string from the stack */ \
+		OPCODE(OP_FIND)  /* look up the function called by `a` (FnInvoke) before its arguments */ \
+		OPCODE(OP_JSR)   /* call `a` (FnInvoke) with `b` arguments or push a parameter */ \
+		OPCODE(OP_RET)   /* return from a subroutine, leaving its result on the stack */ \
+		OPCODE(OP_INVK)  /* call intrinsic `a` with `b` arguments */ \
+		OPCODE(OP_EXEC)  /* execute string on top of the stack as wot++ code */ \
+		OPCODE(OP_SRC)   /* execute the file named on top of the stack */ \
+		OPCODE(OP_DEF)   /* define function `a` */ \
+		OPCODE(OP_DEFP)  /* prefix function `a` with the top string and define it */ \
+		OPCODE(OP_VAR)   /* jump to `b` if variable `a` has already been folded */ \
+		OPCODE(OP_FOLD)  /* fold variable `a` to the top string */ \
+		OPCODE(OP_UNDEF) /* drop the function referred to by `a` (Drop) */ \
+		OPCODE(OP_MATCH) /* pop an arm, compare it to the test and jump to `a` if unequal */ \
+		OPCODE(OP_TABLE) /* pop the test and jump into the table following map `a` */ \
+		OPCODE(OP_JMP)   /* jump to `a` */ \
+		OPCODE(OP_FAIL)  /* no arm of map `a` matched */ \
+		\
+		OPCODE(OP_TOTAL)
+
+	#define OPCODE(x) x,
+		enum: opcode_t { OPCODE_TYPES };
+	#undef OPCODE
+
+	#define OPCODE(x) #x,
+		constexpr const char* opcode_to_str[] = { OPCODE_TYPES };
+	#undef OPCODE
+
+	#undef OPCODE_TYPES
+
+
+	struct Instruction {
+		wpp::opcode_t op = OP_RET;
+		int32_t a = 0, b = 0;
+	};
+
+
+	// A frame is pushed for every subroutine call.
+	// Parameters are not copied into the frame, they stay on the
+	// value stack where the caller evaluated them and `base` points
+	// at the first one.
+	enum: uint8_t {
+		FRAME_ROOT,    // Root of the program passed to `run`.
+		FRAME_CALL,    // Function call, `node` is the Fn.
+		FRAME_EVAL,    // eval or codeify, `node` is the caller.
+		FRAME_SOURCE,  // source, `node` is the Intrinsic.
+	};
+
+	struct StackFrame {
+		size_t ret;
+		size_t base;
+		wpp::node_t node;
+		uint8_t kind;
+		std::filesystem::path path{};  // Directory to restore when returning from `source`.
+	};
+
+
+	// Sizes of the tree and of our buffers when an eval or source frame was
+	// entered. Everything past them can be thrown away when the frame returns
+	// if nothing it created is still referenced.
+	struct Region {
+		wpp::node_t nodes;
+		size_t code;
+		size_t constants;
+		size_t compiled;
+	};
+
+
+	struct VM {
+		wpp::Environment& env;
+
+		std::vector<wpp::Instruction> code;
+		std::vector<std::string_view> constants;  // Views of String nodes.
+
+		// Maps a node to the offset of its compiled chunk.
+		std::vector<int32_t> chunks;
+
+		// Every node that has been compiled, in order.
+		std::vector<wpp::node_t> compiled;
+
+		std::vector<wpp::Region> regions;
+
+		std::vector<std::string> stack;
+		std::vector<wpp::StackFrame> frames;
+
+		// Functions found by `find` whose arguments are being evaluated.
+		std::vector<wpp::node_t> callees;
+
+
+		VM(wpp::Environment& env_): env(env_) {}
+
+		// Compile and execute a tree.
+		std::string run(wpp::node_t root);
+
+
+		// Compile a subroutine ending with `ret`, returns the offset of
+		// its first instruction. Chunks are compiled once and then cached.
+		size_t compile(wpp::node_t node);
+
+		size_t emit(wpp::opcode_t op, int32_t a = 0, int32_t b = 0) {
+			code.push_back({ op, a, b });
+			return code.size() - 1;
+		}
+
+		// Emit an expression which leaves exactly one string on the stack.
+		void expression(wpp::node_t node);
+
+		// Emit a statement, returns the number of strings it leaves on the stack.
+		int statement(wpp::node_t node);
+
+		int prefix(const std::vector<wpp::node_t>& exprs, const std::vector<wpp::node_t>& stmts);
+
+
+		void execute(size_t pc);
+
+		wpp::Region region() const {
+			return { env.tree.mark(), code.size(), constants.size(), compiled.size() };
+		}
+
+		// Release the nodes and code of a region.
+		void reclaim(const wpp::Region& region);
+
+		// Find a parameter by walking the call stack, this gives us the
+		// same dynamic scoping as the tree walker.
+		const std::string* parameter(wpp::symbol_t name) const;
+
+		// Call a compiled chunk, returns the new program counter.
+		size_t call(size_t pc, size_t chunk, size_t base, wpp::node_t node, uint8_t kind);
+	};
+}
+
+#endif
@@ -5,42 +5,161 @@
 
 #include <vector>
 #include <variant>
+#include <memory>
+#include <iterator>
 #include <utility>
+#include <algorithm>
+#include <cassert>
 #include <cstdint>
+#include <cstddef>
 
 // A vector of variants.
+// The first part of the vector can be frozen and shared with other trees,
+// those nodes are never modified again. Everything after them is owned by
+// this tree alone and is stored in fixed size blocks so that adding nodes
+// never moves existing ones, the evaluators hold references to nodes
+// while evaluating code that parses more of them.
 
 namespace wpp {
 	using node_t = int32_t;
 	constexpr node_t NODE_EMPTY = -1;
 
 	template <typename... Ts>
-	class HeterogenousVector: public std::vector<std::variant<Ts...>> {
-		using std::vector<std::variant<Ts...>>::vector;
+	class HeterogenousVector {
+		public:
+			using value_type = std::variant<Ts...>;
+			using Nodes = std::vector<value_type>;
+
+		private:
+			static constexpr node_t BLOCK_BITS = 12;
+			static constexpr node_t BLOCK_SIZE = 1 << BLOCK_BITS;
+			static constexpr node_t BLOCK_MASK = BLOCK_SIZE - 1;
+
+			std::shared_ptr<const Nodes> shared_nodes{};
+			node_t shared_size = 0;
+
+			// Every block has a capacity of BLOCK_SIZE and never grows past
+			// it so its elements stay put. Blocks emptied by `release` are
+			// kept to be filled again.
+			std::vector<Nodes> blocks{};
+			node_t owned = 0;
+
+			void add_block() {
+				blocks.emplace_back();
+				blocks.back().reserve(BLOCK_SIZE);
+			}
 
 		public:
+			HeterogenousVector() = default;
+
+			// Start a tree on top of frozen nodes.
+			HeterogenousVector(std::shared_ptr<const Nodes> frozen):
+				shared_nodes(std::move(frozen)),
+				shared_size(shared_nodes ? static_cast<node_t>(shared_nodes->size()) : 0) {}
+
+
+			// Move every node into the frozen part and return it so that other
+			// trees can be started on top of it. Our blocks are kept.
+			std::shared_ptr<const Nodes> freeze() {
+				if (owned == 0 and shared_nodes)
+					return shared_nodes;
+
+				// Freezing a tree that already has frozen nodes means
+				// copying them, this only happens when forks are forked.
+				Nodes all = shared_nodes ? *shared_nodes : Nodes{};
+				all.reserve(size());
+
+				for (Nodes& block: blocks) {
+					all.insert(all.end(), std::make_move_iterator(block.begin()), std::make_move_iterator(block.end()));
+					block.clear();
+				}
+
+				shared_nodes = std::make_shared<const Nodes>(std::move(all));
+				shared_size = shared_nodes->size();
+				owned = 0;
+
+				return shared_nodes;
+			}
+
+			// Frozen nodes must not be modified, callers that would change a
+			// node check this first and copy it instead.
+			bool shared(node_t i) const {
+				return i < shared_size;
+			}
+
+
+			size_t size() const {
+				return shared_size + owned;
+			}
+
+			void reserve(size_t n) {
+				while (blocks.size() * BLOCK_SIZE < n)
+					add_block();
+			}
+
+
+			const value_type& operator[](node_t i) const {
+				if (i < shared_size)
+					return (*shared_nodes)[i];
+
+				i -= shared_size;
+				return blocks[i >> BLOCK_BITS][i & BLOCK_MASK];
+			}
+
+			// Only nodes owned by this tree can be modified.
+			value_type& modify(node_t i) {
+				assert(not shared(i));
+
+				i -= shared_size;
+				return blocks[i >> BLOCK_BITS][i & BLOCK_MASK];
+			}
+
+
 			// Construct element in place and return its index.
 			template <typename T, typename... Xs>
 			node_t add(Xs&&... args) {
-				this->emplace_back(std::in_place_type<T>, std::forward<Xs>(args)...);
-				return static_cast<int64_t>(this->size() - 1);
+				if (static_cast<size_t>(owned >> BLOCK_BITS) == blocks.size())
+					add_block();
+
+				blocks[owned >> BLOCK_BITS].emplace_back(std::in_place_type<T>, std::forward<Xs>(args)...);
+				owned++;
+
+				return static_cast<node_t>(size() - 1);
+			}
+
+			// Nodes are only ever appended, so everything added after a
+			// mark can be freed in one go by releasing back to it.
+			// Blocks are kept so that the space is reused.
+			node_t mark() const {
+				return static_cast<node_t>(size());
+			}
+
+			void release(node_t mark) {
+				const node_t keep = mark - shared_size;
+
+				for (size_t b = keep >> BLOCK_BITS; b < blocks.size() and not blocks[b].empty(); ++b) {
+					const node_t start = static_cast<node_t>(b) << BLOCK_BITS;
+					blocks[b].erase(blocks[b].begin() + std::max<node_t>(0, keep - start), blocks[b].end());
+				}
+
+				owned = keep;
 			}
 
 			template <typename T, typename... Xs>
 			auto& replace(node_t i, Xs&&... args) {
-				return (*this)[i].template emplace<T>(std::forward<Xs>(args)...);
+				return modify(i).template emplace<T>(std::forward<Xs>(args)...);
 			}
 
 			// Retrieve element by index and pull the underlying type out of
 			// the variant.
 			template <typename T>
-			T& get(node_t i) {
+			const T& get(node_t i) const {
 				return std::get<T>((*this)[i]);
 			}
 
 			template <typename T>
-			const T& get(node_t i) const {
-				return std::get<T>((*this)[i]);
+			T& get_mut(node_t i) {
+				return std::get<T>(modify(i));
 			}
 	};
 }
@@ -4,6 +4,7 @@
 #define WOTPP_CHAR
 
 #include <utility>
+#include <array>
 #include <cstdint>
 
 // Common character related utilities.
@@ -18,6 +19,42 @@ namespace wpp {
 		return c >= lower and c <= upper;
 	}
 
+
+	// Character classes.
+	// Every byte maps to a set of flags so that the lexer can classify a
+	// character with a single load instead of a chain of comparisons.
+	enum: uint8_t {
+		CHAR_WHITESPACE      = 1 << 0,
+		CHAR_HEX             = 1 << 1,
+		CHAR_IDENTIFIER_END  = 1 << 2,  // Can't appear in an identifier.
+		CHAR_IDENTIFIER_PAIR = 1 << 3,  // Ends an identifier if followed by a certain character (`..` and `#[`).
+	};
+
+	constexpr std::array<uint8_t, 256> char_classes = [] {
+		std::array<uint8_t, 256> table{};
+
+		for (const char c: { ' ', '\n', '\t', '\v', '\f', '\r' })
+			table[static_cast<uint8_t>(c)] |= CHAR_WHITESPACE | CHAR_IDENTIFIER_END;
+
+		for (int c = 0; c != 256; ++c) {
+			if (in_range(c, '0', '9') or in_range(c, 'a', 'f') or in_range(c, 'A', 'F'))
+				table[c] |= CHAR_HEX;
+		}
+
+		for (const char c: { '(', ')', '{', '}', ',', '\0', '\'', '"' })
+			table[static_cast<uint8_t>(c)] |= CHAR_IDENTIFIER_END;
+
+		for (const char c: { '.', '#' })
+			table[static_cast<uint8_t>(c)] |= CHAR_IDENTIFIER_PAIR;
+
+		return table;
+	} ();
+
+	constexpr uint8_t char_class(char c) {
+		return char_classes[static_cast<uint8_t>(c)];
+	}
+
+
 	constexpr bool is_digit(char c) {
 		return in_range(c, '0', '9');
 	}
@@ -39,11 +76,11 @@ namespace wpp {
 	}
 
 	constexpr bool is_whitespace(char c) {
-		return in_group(c, ' ', '\n', '\t', '\v', '\f', '\r');
+		return char_class(c) & CHAR_WHITESPACE;
 	}
 
 	constexpr bool is_hex(char c) {
-		return in_range(c, 'A', 'F') or in_range(c, 'a', 'f') or is_digit(c);
+		return char_class(c) & CHAR_HEX;
 	}
 
 	constexpr bool is_bin(char c) {
@@ -1,4 +1,8 @@
+#include <array>
+#include <string_view>
+
 #include <frontend/lexer/lexer.hpp>
+#include <frontend/lexer/scan.hpp>
 #include <structures/exception.hpp>
 #include <frontend/char.hpp>
 
@@ -63,6 +67,107 @@ namespace wpp {
 
 
 namespace wpp {
+	// Keywords are found with a perfect hash of their first character,
+	// last character and length. The table is built at compile time and
+	// a collision is a compile error.
+	constexpr size_t keyword_hash(char first, char last, size_t length) {
+		return (static_cast<uint8_t>(first) * 3 + static_cast<uint8_t>(last) * 26 + length) & 31;
+	}
+
+	struct Keyword {
+		std::string_view str{};
+		wpp::token_type_t type = TOKEN_IDENTIFIER;
+	};
+
+	constexpr std::array<Keyword, 32> keywords = [] {
+		constexpr Keyword list[] = {
+			{ "let",    TOKEN_LET },
+			{ "prefix", TOKEN_PREFIX },
+			{ "map",    TOKEN_MAP },
+			{ "run",    TOKEN_RUN },
+			{ "eval",   TOKEN_EVAL },
+			{ "file",   TOKEN_FILE },
+			{ "assert", TOKEN_ASSERT },
+			{ "pipe",   TOKEN_PIPE },
+			{ "error",  TOKEN_ERROR },
+			{ "source", TOKEN_SOURCE },
+			{ "escape", TOKEN_ESCAPE },
+			{ "slice",  TOKEN_SLICE },
+			{ "find",   TOKEN_FIND },
+			{ "length", TOKEN_LENGTH },
+			{ "log",    TOKEN_LOG },
+			{ "drop",   TOKEN_DROP },
+			{ "var",    TOKEN_VAR },
+		};
+
+		std::array<Keyword, 32> table{};
+
+		for (const auto& kw: list) {
+			auto& slot = table[keyword_hash(kw.str.front(), kw.str.back(), kw.str.size())];
+
+			if (not slot.str.empty())
+				throw "keyword hash collision";
+
+			slot = kw;
+		}
+
+		return table;
+	} ();
+
+
+	// Normal mode dispatches on the first character of the token.
+	// Anything that isn't the start of another token is an identifier.
+	using lex_fn_t = void(*)(wpp::Lexer&, wpp::Token&);
+
+	constexpr std::array<lex_fn_t, 256> lex_normal_table = [] {
+		std::array<lex_fn_t, 256> table{};
+
+		for (auto& fn: table)
+			fn = lex_identifier;
+
+		table['p'] = table['r'] = table['c'] = lex_smart;
+
+		table['0'] = [] (wpp::Lexer& lex, wpp::Token& tok) {
+			if (*(lex.str + 1) == 'b')
+				lex_literal(TOKEN_BIN, wpp::is_bin, lex, tok);
+
+			else if (*(lex.str + 1) == 'x')
+				lex_literal(TOKEN_HEX, wpp::is_hex, lex, tok);
+
+			else
+				lex_identifier(lex, tok);
+		};
+
+		table['.'] = [] (wpp::Lexer& lex, wpp::Token& tok) {
+			if (*(lex.str + 1) == '.')
+				lex_simple(TOKEN_CAT, 2, lex, tok);
+
+			else
+				lex_identifier(lex, tok);
+		};
+
+		table['-'] = [] (wpp::Lexer& lex, wpp::Token& tok) {
+			if (*(lex.str + 1) == '>')
+				lex_simple(TOKEN_ARROW, 2, lex, tok);
+
+			else
+				lex_identifier(lex, tok);
+		};
+
+		table[','] = [] (wpp::Lexer& lex, wpp::Token& tok) { lex_simple(TOKEN_COMMA,   1, lex, tok); };
+		table['|'] = [] (wpp::Lexer& lex, wpp::Token& tok) { lex_simple(TOKEN_BAR,     1, lex, tok); };
+		table['='] = [] (wpp::Lexer& lex, wpp::Token& tok) { lex_simple(TOKEN_EQUAL,   1, lex, tok); };
+		table['!'] = [] (wpp::Lexer& lex, wpp::Token& tok) { lex_simple(TOKEN_EXCLAIM, 1, lex, tok); };
+		table['*'] = [] (wpp::Lexer& lex, wpp::Token& tok) { lex_simple(TOKEN_STAR,    1, lex, tok); };
+		table['('] = [] (wpp::Lexer& lex, wpp::Token& tok) { lex_simple(TOKEN_LPAREN,  1, lex, tok); };
+		table[')'] = [] (wpp::Lexer& lex, wpp::Token& tok) { lex_simple(TOKEN_RPAREN,  1, lex, tok); };
+		table['{'] = [] (wpp::Lexer& lex, wpp::Token& tok) { lex_simple(TOKEN_LBRACE,  1, lex, tok); };
+		table['}'] = [] (wpp::Lexer& lex, wpp::Token& tok) { lex_simple(TOKEN_RBRACE,  1, lex, tok); };
+
+		return table;
+	} ();
+
+
 	void lex_comment(wpp::Lexer& lex, wpp::Token& tok) {
 		auto [start, ptr] = lex.get_ptrs();
 
@@ -75,7 +180,7 @@ namespace wpp {
 		// and skip comment contents.
 		int depth = 1;
 
-		while (depth > 0 and *ptr != '\0') {
+		while (depth > 0 and *(ptr = wpp::scan_comment(ptr)) != '\0') {
 			if (*ptr == '#' and *(ptr + 1) == '[')
 				depth++, lex.next(2);
 
@@ -87,7 +192,7 @@ namespace wpp {
 		}
 
 		if (*ptr == '\0' and depth != 0)
-			throw wpp::Exception{wpp::position(lex.fname, start, ptr), "unterminated comment."};
+			throw wpp::Exception{lex.position(ptr), "unterminated comment."};
 
 		// Update view pointer so when the lexer continues, the token starts
 		// at the right location.
@@ -102,7 +207,12 @@ namespace wpp {
 		auto& [vptr, vlen] = view;
 
 		lex.next();
-		while (lex.next() != '\n');
+
+		// Skip up to and including the newline.
+		ptr = wpp::scan_line(ptr);
+
+		if (*ptr == '\n')
+			lex.next();
 
 		vptr = ptr;
 	}
@@ -152,10 +262,12 @@ namespace wpp {
 
 
 	void lex_whitespace(wpp::Lexer& lex, wpp::Token& tok) {
-		// Consume as much whitespace as we can.
-		do {
-			lex.next();
-		} while (wpp::is_whitespace(*lex.str));
+		lex.next();
+
+		// Most whitespace is a single space or newline so we only use the
+		// bulk scanner for longer runs like indentation.
+		if (wpp::is_whitespace(*lex.str))
+			lex.str = wpp::scan_whitespace(lex.str);
 
 		// Update view pointer so when the lexer continues, the token starts
 		// at the right location.
@@ -172,35 +284,32 @@ namespace wpp {
 		type = TOKEN_IDENTIFIER;
 
 		// Make sure we don't run into a character that belongs to another token.
-		while (
-			not wpp::is_whitespace(*ptr) and
-			not wpp::in_group(*ptr, '(', ')', '{', '}', ',', '\0', '\'', '"') and
-			not (*ptr == '.' and *(ptr + 1) == '.') and
-			not (*ptr == '#' and *(ptr + 1) == '[')
-		)
+		while (true) {
+			const uint8_t cls = wpp::char_class(*ptr);
+
+			if (cls & wpp::CHAR_IDENTIFIER_END)
+				break;
+
+			if (cls & wpp::CHAR_IDENTIFIER_PAIR and (
+				(*ptr == '.' and *(ptr + 1) == '.') or
+				(*ptr == '#' and *(ptr + 1) == '[')
+			))
+				break;
+
 			lex.next();
+		}
 
 		// Set length to the number of consumed characters.
 		vlen = ptr - vptr;
 
 		// Check if consumed string is actually a keyword.
-		if      (view == "let")       type = TOKEN_LET;
-		else if (view == "prefix")    type = TOKEN_PREFIX;
-		else if (view == "map")       type = TOKEN_MAP;
-		else if (view == "run")       type = TOKEN_RUN;
-		else if (view == "eval")      type = TOKEN_EVAL;
-		else if (view == "file")      type = TOKEN_FILE;
-		else if (view == "assert")    type = TOKEN_ASSERT;
-		else if (view == "pipe")      type = TOKEN_PIPE;
-		else if (view == "error")     type = TOKEN_ERROR;
-		else if (view == "source")    type = TOKEN_SOURCE;
-		else if (view == "escape")    type = TOKEN_ESCAPE;
-		else if (view == "slice")     type = TOKEN_SLICE;
-		else if (view == "find")      type = TOKEN_FIND;
-		else if (view == "length")    type = TOKEN_LENGTH;
-		else if (view == "log")       type = TOKEN_LOG;
-		else if (view == "drop")      type = TOKEN_DROP;
-		else if (view == "var")       type = TOKEN_VAR;
+		if (vlen == 0)
+			return;
+
+		const auto& [keyword, keyword_type] = keywords[keyword_hash(vptr[0], vptr[vlen - 1], vlen)];
+
+		if (keyword == view.str_view())
+			type = keyword_type;
 	}
 
 
@@ -234,7 +343,7 @@ namespace wpp {
 
 			// Check if nibbles are valid digits.
 			if (not wpp::is_hex(first_nibble) or not wpp::is_hex(second_nibble))
-				throw wpp::Exception{wpp::position(lex.fname, start, vptr), "invalid character in hex escape."};
+				throw wpp::Exception{lex.position(vptr), "invalid character in hex escape."};
 		}
 
 		// Bin escape \b00001111.
@@ -247,7 +356,7 @@ namespace wpp {
 			// Consume 8 characters, check if each one is a valid digit.
 			for (; ptr != vptr + 8; lex.next()) {
 				if (not wpp::is_bin(*ptr))
-					throw wpp::Exception{wpp::position(lex.fname, start, vptr), "invalid character in bin escape."};
+					throw wpp::Exception{lex.position(vptr), "invalid character in bin escape."};
 			}
 		}
 
@@ -260,8 +369,7 @@ namespace wpp {
 		tok.type = TOKEN_STRING;
 
 		// Consume all characters except quotes, escapes and EOF.
-		while (not wpp::in_group(*lex.str, '\\', '"', '\'', '\0'))
-			++lex.str;
+		lex.str = wpp::scan_string(lex.str);
 
 		// Set view length equal to the number of consumed characters.
 		tok.view.length = lex.str - tok.view.ptr;
@@ -278,49 +386,6 @@ namespace wpp {
 
 
 	void lex_mode_normal(wpp::Lexer& lex, wpp::Token& tok) {
-		if (wpp::in_group(*lex.str, 'p', 'r', 'c'))
-			lex_smart(lex, tok);
-
-		else if (*lex.str == '0' and *(lex.str + 1) == 'b')
-			lex_literal(TOKEN_BIN, wpp::is_bin, lex, tok);
-
-		else if (*lex.str == '0' and *(lex.str + 1) == 'x')
-			lex_literal(TOKEN_HEX, wpp::is_hex, lex, tok);
-
-		else if (*lex.str == '.' and *(lex.str + 1) == '.')
-			lex_simple(TOKEN_CAT, 2, lex, tok);
-
-		else if (*lex.str == '-' and *(lex.str + 1) == '>')
-			lex_simple(TOKEN_ARROW, 2, lex, tok);
-
-		else if (*lex.str == ',')
-			lex_simple(TOKEN_COMMA, 1, lex, tok);
-
-		else if (*lex.str == '|')
-			lex_simple(TOKEN_BAR, 1, lex, tok);
-
-		else if (*lex.str == '=')
-			lex_simple(TOKEN_EQUAL, 1, lex, tok);
-
-		else if (*lex.str == '!')
-			lex_simple(TOKEN_EXCLAIM, 1, lex, tok);
-
-		else if (*lex.str == '*')
-			lex_simple(TOKEN_STAR, 1, lex, tok);
-
-		else if (*lex.str == '(')
-			lex_simple(TOKEN_LPAREN, 1, lex, tok);
-
-		else if (*lex.str == ')')
-			lex_simple(TOKEN_RPAREN, 1, lex, tok);
-
-		else if (*lex.str == '{')
-			lex_simple(TOKEN_LBRACE, 1, lex, tok);
-
-		else if (*lex.str == '}')
-			lex_simple(TOKEN_RBRACE, 1, lex, tok);
-
-		else
-			lex_identifier(lex, tok);
+		lex_normal_table[static_cast<uint8_t>(*lex.str)](lex, tok);
 	}
 }
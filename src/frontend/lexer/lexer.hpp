@@ -120,7 +120,7 @@ namespace wpp::modes {
 
 namespace wpp {
 	struct Lexer {
-		std::string fname;
+		wpp::file_id_t file = 0;
 		const char* const start = nullptr;
 		const char* str = nullptr;
 
@@ -128,10 +128,11 @@ namespace wpp {
 		int lookahead_mode = modes::normal;
 
 
-		Lexer(const std::string& fname_, const char* const str_, int mode_ = modes::normal):
-			fname(fname_),
-			start(str_),
-			str(str_),
+		// Lex a file from the file table.
+		Lexer(const wpp::file_id_t file_, int mode_ = modes::normal):
+			file(file_),
+			start(wpp::file_contents(file_)),
+			str(start),
 			lookahead(),
 			lookahead_mode(mode_)
 		{
@@ -175,8 +176,13 @@ namespace wpp {
 			return tok;
 		}
 
-		wpp::Position position(int line_offset = 0, int column_offset = 0) const {
-			return wpp::position(fname, start, lookahead.view.ptr, line_offset, column_offset);
+		// Position of the lookahead token.
+		wpp::Position position() const {
+			return position(lookahead.view.ptr);
+		}
+
+		wpp::Position position(const char* const ptr) const {
+			return { file, static_cast<uint32_t>(ptr - start) };
 		}
 
 		wpp::Token next_token(int mode = modes::normal);
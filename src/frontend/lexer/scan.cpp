@@ -0,0 +1,162 @@
+#include <cstdint>
+
+#include <frontend/char.hpp>
+#include <frontend/lexer/scan.hpp>
+
+#if defined(__GNUC__) and (defined(__x86_64__) or defined(__i386__))
+	#define WPP_SCAN_X86
+	#include <immintrin.h>
+#endif
+
+
+namespace wpp {
+	namespace {
+		template <char... Cs>
+		const char* find_scalar(const char* ptr) {
+			while (not ((*ptr == Cs) or ...))
+				++ptr;
+
+			return ptr;
+		}
+
+		const char* skip_whitespace_scalar(const char* ptr) {
+			while (wpp::is_whitespace(*ptr))
+				++ptr;
+
+			return ptr;
+		}
+
+
+		#ifdef WPP_SCAN_X86
+			// Each scanner builds a mask with a bit set for every byte that
+			// should stop the scan and returns a pointer to the first one.
+
+			template <char... Cs>
+			__attribute__((target("sse2")))
+			const char* find_sse2(const char* ptr) {
+				while (true) {
+					const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr));
+
+					__m128i hit = _mm_setzero_si128();
+					((hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, _mm_set1_epi8(Cs)))), ...);
+
+					if (const uint32_t mask = _mm_movemask_epi8(hit))
+						return ptr + __builtin_ctz(mask);
+
+					ptr += 16;
+				}
+			}
+
+			template <char... Cs>
+			__attribute__((target("avx2")))
+			const char* find_avx2(const char* ptr) {
+				while (true) {
+					const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr));
+
+					__m256i hit = _mm256_setzero_si256();
+					((hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(Cs)))), ...);
+
+					if (const uint32_t mask = _mm256_movemask_epi8(hit))
+						return ptr + __builtin_ctz(mask);
+
+					ptr += 32;
+				}
+			}
+
+
+			// Whitespace is ' ' or anything in the range '\t'..'\r'.
+			// The range check is done as an unsigned `c - '\t' <= 4`.
+			__attribute__((target("sse2")))
+			const char* skip_whitespace_sse2(const char* ptr) {
+				while (true) {
+					const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr));
+					const __m128i off = _mm_sub_epi8(v, _mm_set1_epi8('\t'));
+
+					const __m128i ws = _mm_or_si128(
+						_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+						_mm_cmpeq_epi8(_mm_min_epu8(off, _mm_set1_epi8(4)), off)
+					);
+
+					if (const uint32_t mask = ~_mm_movemask_epi8(ws) & 0xFFFF)
+						return ptr + __builtin_ctz(mask);
+
+					ptr += 16;
+				}
+			}
+
+			__attribute__((target("avx2")))
+			const char* skip_whitespace_avx2(const char* ptr) {
+				while (true) {
+					const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr));
+					const __m256i off = _mm256_sub_epi8(v, _mm256_set1_epi8('\t'));
+
+					const __m256i ws = _mm256_or_si256(
+						_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+						_mm256_cmpeq_epi8(_mm256_min_epu8(off, _mm256_set1_epi8(4)), off)
+					);
+
+					if (const uint32_t mask = ~static_cast<uint32_t>(_mm256_movemask_epi8(ws)))
+						return ptr + __builtin_ctz(mask);
+
+					ptr += 32;
+				}
+			}
+
+
+		#endif
+
+
+		using scan_fn_t = const char*(*)(const char*);
+
+		struct Scanners {
+			scan_fn_t string, comment, line, whitespace;
+		};
+
+		// Pick the best implementation once at startup.
+		const Scanners scanners = [] () -> Scanners {
+			#ifdef WPP_SCAN_X86
+				__builtin_cpu_init();
+
+				if (__builtin_cpu_supports("avx2"))
+					return {
+						find_avx2<'\\', '"', '\'', '\0'>,
+						find_avx2<'#', ']', '\0'>,
+						find_avx2<'\n', '\0'>,
+						skip_whitespace_avx2,
+					};
+
+				if (__builtin_cpu_supports("sse2"))
+					return {
+						find_sse2<'\\', '"', '\'', '\0'>,
+						find_sse2<'#', ']', '\0'>,
+						find_sse2<'\n', '\0'>,
+						skip_whitespace_sse2,
+					};
+			#endif
+
+			return {
+				find_scalar<'\\', '"', '\'', '\0'>,
+				find_scalar<'#', ']', '\0'>,
+				find_scalar<'\n', '\0'>,
+				skip_whitespace_scalar,
+			};
+		} ();
+	}
+
+
+	const char* scan_string(const char* ptr) {
+		return scanners.string(ptr);
+	}
+
+	const char* scan_comment(const char* ptr) {
+		return scanners.comment(ptr);
+	}
+
+	const char* scan_line(const char* ptr) {
+		return scanners.line(ptr);
+	}
+
+	const char* scan_whitespace(const char* ptr) {
+		return scanners.whitespace(ptr);
+	}
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#ifndef WOTPP_SCAN
+#define WOTPP_SCAN
+
+// Bulk scanners used by the lexer to skip over long runs of characters
+// that don't need to be looked at individually.
+// On x86 these use AVX2 or SSE2 depending on what the CPU supports and
+// read 16 or 32 bytes at a time, which relies on file buffers being
+// padded (see `wpp::FILE_PADDING`). Other targets use a scalar loop.
+
+namespace wpp {
+	// Find the first `\`, `"`, `'` or NUL.
+	const char* scan_string(const char* ptr);
+
+	// Find the first `#`, `]` or NUL.
+	const char* scan_comment(const char* ptr);
+
+	// Find the first newline or NUL.
+	const char* scan_line(const char* ptr);
+
+	// Find the first character that isn't whitespace.
+	const char* scan_whitespace(const char* ptr);
+}
+
+#endif
@@ -5,24 +5,32 @@
 
 #include <utility>
 #include <variant>
+#include <memory>
+#include <unordered_map>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include <frontend/token.hpp>
 #include <frontend/position.hpp>
 #include <frontend/ast.hpp>
+#include <structures/symbol.hpp>
 
 
 // AST nodes.
 namespace wpp {
 	// A function call.
+	// If the call refers to a parameter of the function it appears in,
+	// `slot` is the index of that parameter, otherwise it is -1 and the
+	// name has to be looked up at runtime.
 	struct FnInvoke {
-		std::string identifier;
+		wpp::symbol_t identifier;
 		std::vector<wpp::node_t> arguments;
+		int32_t slot = -1;
 		wpp::Position pos;
 
 		FnInvoke(
-			const std::string& identifier_,
+			const wpp::symbol_t identifier_,
 			const std::vector<wpp::node_t>& arguments_,
 			const wpp::Position& pos_
 		):
@@ -59,14 +67,14 @@ namespace wpp {
 
 	// Function definition.
 	struct Fn {
-		std::string identifier;
-		std::vector<std::string> parameters;
+		wpp::symbol_t identifier;
+		std::vector<wpp::symbol_t> parameters;
 		wpp::node_t body;
 		wpp::Position pos;
 
 		Fn(
-			const std::string& identifier_,
-			const std::vector<std::string>& parameters_,
+			const wpp::symbol_t identifier_,
+			const std::vector<wpp::symbol_t>& parameters_,
 			const wpp::node_t body_,
 			const wpp::Position& pos_
 		):
@@ -98,12 +106,12 @@ namespace wpp {
 
 	// Variable definition.
 	struct Var {
-		std::string identifier;
+		wpp::symbol_t identifier;
 		wpp::node_t body;
 		wpp::Position pos;
 
 		Var(
-			const std::string& identifier_,
+			const wpp::symbol_t identifier_,
 			const wpp::node_t body_,
 			const wpp::Position& pos_
 		):
@@ -129,13 +137,26 @@ namespace wpp {
 	};
 
 	// String literal.
+	// The value points into the source file it was parsed from unless we
+	// had to build it ourselves, like literals with escape sequences, in
+	// which case the node owns it and it is freed along with the node.
 	struct String {
-		std::string value;
+		std::string_view value;
 		wpp::Position pos;
 
-		String(const std::string& value_, const wpp::Position& pos_):
+		// Shared rather than unique because frozen nodes may be copied,
+		// `value` must stay put either way.
+		std::shared_ptr<const std::string> owned{};
+
+		String(std::string_view value_, const wpp::Position& pos_):
 			value(value_), pos(pos_) {}
 
+		String(std::string&& owned_, const wpp::Position& pos_):
+			pos(pos_), owned(std::make_shared<const std::string>(std::move(owned_)))
+		{
+			value = *owned;
+		}
+
 		String(const wpp::Position& pos_): pos(pos_) {}
 
 		String() {}
@@ -195,10 +216,15 @@ namespace wpp {
 	};
 
 	// Map strings to new strings.
+	// If every arm is a string literal, `index` maps the value of each arm
+	// to its position in `cases` so that we don't have to scan them.
 	struct Map {
+		using Index = std::unordered_map<std::string_view, size_t>;
+
 		wpp::node_t expr;
 		std::vector<std::pair<wpp::node_t, wpp::node_t>> cases;
 		wpp::node_t default_case;
+		std::shared_ptr<const Index> index;
 		wpp::Position pos;
 
 		Map(
@@ -210,6 +236,7 @@ namespace wpp {
 			expr(expr_),
 			cases(cases_),
 			default_case(default_case_),
+			index(),
 			pos(pos_) {}
 
 		Map(const wpp::Position& pos_): pos(pos_) {}
@@ -72,6 +72,65 @@ namespace wpp {
 
 
 
+	// Walk a function body and bind calls that refer to one of its parameters
+	// to the parameter's slot in the frame. We don't descend into nested
+	// functions because their bodies are evaluated with their own frame,
+	// they are resolved when they are parsed instead.
+	void resolve_params(wpp::node_t node_id, const std::vector<wpp::symbol_t>& params, wpp::AST& tree) {
+		if (node_id == wpp::NODE_EMPTY or params.empty())
+			return;
+
+		// Collect children first so we aren't holding a reference into
+		// the tree while recursing.
+		std::vector<wpp::node_t> children;
+
+		wpp::visit(tree.modify(node_id),
+			[&] (FnInvoke& call) {
+				// Later parameters shadow earlier ones with the same name.
+				if (call.arguments.empty()) {
+					for (size_t i = params.size(); i > 0; --i) {
+						if (params[i - 1] == call.identifier) {
+							call.slot = i - 1;
+							break;
+						}
+					}
+				}
+
+				children = call.arguments;
+			},
+
+			[&] (Intrinsic& fn) { children = fn.arguments; },
+			[&] (Codeify& colby) { children = { colby.expr }; },
+			[&] (Var& var) { children = { var.body }; },
+			[&] (Concat& cat) { children = { cat.lhs, cat.rhs }; },
+
+			[&] (Block& block) {
+				children = block.statements;
+				children.emplace_back(block.expr);
+			},
+
+			[&] (Pre& pre) {
+				children = pre.exprs;
+				children.insert(children.end(), pre.statements.begin(), pre.statements.end());
+			},
+
+			[&] (Map& map) {
+				children = { map.expr, map.default_case };
+
+				for (const auto& [arm, hand]: map.cases) {
+					children.emplace_back(arm);
+					children.emplace_back(hand);
+				}
+			},
+
+			[&] (auto&) {}  // Fn, Drop, String and Document.
+		);
+
+		for (const wpp::node_t child: children)
+			resolve_params(child, params, tree);
+	}
+
+
 	// Parses a function.
 	wpp::node_t let(wpp::Lexer& lex, wpp::AST& tree) {
 		// Create `Fn` node ahead of time so we can insert member data
@@ -88,7 +147,7 @@ namespace wpp {
 		if (lex.peek() != TOKEN_IDENTIFIER)
 			throw wpp::Exception{lex.position(), "function declaration does not have a name."};
 
-		tree.get<Fn>(node).identifier = lex.advance().str();
+		tree.get_mut<Fn>(node).identifier = wpp::intern(lex.advance().view.str_view());
 
 
 		// Collect parameters.
@@ -100,10 +159,10 @@ namespace wpp {
 			// While there is an identifier there is another parameter.
 			while (lex.peek() == TOKEN_IDENTIFIER) {
 				// Advance the lexer and get the identifier.
-				auto id = lex.advance().str();
+				const auto id = wpp::intern(lex.advance().view.str_view());
 
 				// Add the argument
-				tree.get<Fn>(node).parameters.emplace_back(id);
+				tree.get_mut<Fn>(node).parameters.emplace_back(id);
 
 				// If the next token is a comma, skip it.
 				if (lex.peek() == TOKEN_COMMA)
@@ -130,7 +189,11 @@ namespace wpp {
 
 		// Parse the function body.
 		const wpp::node_t body = expression(lex, tree);
-		tree.get<Fn>(node).body = body;
+		tree.get_mut<Fn>(node).body = body;
+
+		// Resolve references to our parameters ahead of time.
+		const auto params = tree.get<Fn>(node).parameters;
+		resolve_params(body, params, tree);
 
 		return node;
 	}
@@ -150,11 +213,11 @@ namespace wpp {
 		if (lex.peek() != TOKEN_IDENTIFIER)
 			throw wpp::Exception{lex.position(), "variable declaration does not have a name."};
 
-		tree.get<Var>(node).identifier = lex.advance().str();
+		tree.get_mut<Var>(node).identifier = wpp::intern(lex.advance().view.str_view());
 
 		// Parse the variable body.
 		const wpp::node_t body = expression(lex, tree);
-		tree.get<Var>(node).body = body;
+		tree.get_mut<Var>(node).body = body;
 
 		return node;
 	}
@@ -169,7 +232,7 @@ namespace wpp {
 		wpp::node_t node = tree.add<Codeify>(lex.position());
 
 		const wpp::node_t expr = wpp::expression(lex, tree);
-		tree.get<Codeify>(node).expr = expr;
+		tree.get_mut<Codeify>(node).expr = expr;
 
 		return node;
 	}
@@ -181,35 +244,60 @@ namespace wpp {
 		const wpp::node_t node = tree.add<Drop>(lex.position());
 
 		const wpp::node_t call_expr = wpp::fninvoke(lex, tree);
-		tree.get<Drop>(node).func = call_expr;
+		tree.get_mut<Drop>(node).func = call_expr;
 
 		return node;
 	}
 
 
-	void normal_string(wpp::Lexer& lex, std::string& str) {
+	// Escape-free strings are returned as a view of the source, otherwise the
+	// string is built up in `str` and the view refers to that instead.
+	std::string_view normal_string(wpp::Lexer& lex, std::string& str) {
 		const auto delim = lex.advance(wpp::modes::string); // Store delimeter.
 
+		const char* const begin = delim.view.ptr + delim.view.length;
+		const char* end = begin;
+		bool escaped = false;
+
 		// Consume tokens until we reach `delim` or EOF.
 		while (lex.peek(wpp::modes::string) != delim) {
 			if (lex.peek(wpp::modes::string) == TOKEN_EOF)
 				throw wpp::Exception{lex.position(), "reached EOF while parsing string."};
 
+			const auto part = lex.advance(wpp::modes::string);
+
+			// Plain parts are contiguous in the source so we only need to
+			// extend the view until we see the first escape sequence.
+			if (not escaped and not peek_is_escape(part)) {
+				end = part.view.ptr + part.view.length;
+				continue;
+			}
+
+			if (not escaped) {
+				str.assign(begin, end);
+				escaped = true;
+			}
+
 			// Parse escape characters and append "parts" of the string to `str`.
-			accumulate_string(lex.advance(wpp::modes::string), str);
+			accumulate_string(part, str);
 		}
 
 		lex.advance(); // Skip terminating quote.
+
+		if (escaped)
+			return str;
+
+		return { begin, static_cast<size_t>(end - begin) };
 	}
 
 
-	void stringify_string(wpp::Lexer& lex, std::string& str) {
+	std::string_view stringify_string(wpp::Lexer& lex) {
 		lex.advance(); // skip '`'.
 
 		if (lex.peek() != TOKEN_IDENTIFIER)
 			throw wpp::Exception{lex.position(), "expected an identifier to follow !."};
 
-		str = lex.advance().str();
+		return lex.advance().view.str_view();
 	}
 
 
@@ -429,25 +517,41 @@ namespace wpp {
 	wpp::node_t string(wpp::Lexer& lex, wpp::AST& tree) {
 		// Create our string node.
 		const wpp::node_t node = tree.add<String>(lex.position());
-		auto& [literal, pos] = tree.get<String>(node);
 
-		// Reserve some space, this is kind of arbitrary.
-		literal.reserve(1024);
+		// Strings which need processing are built up here.
+		std::string str;
+		std::string_view literal;
 
-		if (lex.peek() == TOKEN_HEX)
-			hex_string(lex, literal);
+		if (lex.peek() == TOKEN_HEX) {
+			hex_string(lex, str);
+			literal = str;
+		}
 
-		else if (lex.peek() == TOKEN_BIN)
-			bin_string(lex, literal);
+		else if (lex.peek() == TOKEN_BIN) {
+			bin_string(lex, str);
+			literal = str;
+		}
 
-		else if (lex.peek() == TOKEN_SMART)
-			smart_string(lex, literal);
+		else if (lex.peek() == TOKEN_SMART) {
+			smart_string(lex, str);
+			literal = str;
+		}
 
 		else if (lex.peek() == TOKEN_EXCLAIM)
-			stringify_string(lex, literal);
+			literal = stringify_string(lex);
 
 		else if (lex.peek() == TOKEN_QUOTE or lex.peek() == TOKEN_DOUBLEQUOTE)
-			normal_string(lex, literal);
+			literal = normal_string(lex, str);
+
+		// Anything we had to build is handed to the node, the rest refers
+		// directly to the source which is kept alive by the file table.
+		if (literal.data() == str.data()) {
+			const wpp::Position pos = tree.get<String>(node).pos;
+			tree.replace<String>(node, std::move(str), pos);
+		}
+
+		else
+			tree.get_mut<String>(node).value = literal;
 
 		return node;
 	}
@@ -466,7 +570,7 @@ namespace wpp {
 			while (peek_is_expr(lex.peek())) {
 				// Parse expr.
 				wpp::node_t expr = expression(lex, tree);
-				tree.get<FnInvoke>(node).arguments.emplace_back(expr);
+				tree.get_mut<FnInvoke>(node).arguments.emplace_back(expr);
 
 				// If the next token is a comma, skip it.
 				if (lex.peek() == TOKEN_COMMA)
@@ -488,12 +592,12 @@ namespace wpp {
 		// If it is an intrinsic, we replace the FnInvoke node type with
 		// the Intrinsic node type and forward the arguments.
 		if (peek_is_intrinsic(fn_token)) {
-			const auto [_, args, pos] = tree.get<FnInvoke>(node);
+			const auto [_, args, slot, pos] = tree.get<FnInvoke>(node);
 			tree.replace<Intrinsic>(node, fn_token.type, fn_token.str(), args, pos);
 		}
 
 		else
-			tree.get<FnInvoke>(node).identifier = fn_token.str();
+			tree.get_mut<FnInvoke>(node).identifier = wpp::intern(fn_token.view.str_view());
 
 		return node;
 	}
@@ -515,7 +619,7 @@ namespace wpp {
 
 		// Set name of `Pre`.
 		const wpp::node_t expr = wpp::expression(lex, tree);
-		tree.get<Pre>(node).exprs = {expr};
+		tree.get_mut<Pre>(node).exprs = {expr};
 
 
 		// Expect opening brace.
@@ -533,7 +637,7 @@ namespace wpp {
 			// be invalidated.
 			do {
 				const wpp::node_t stmt = statement(lex, tree);
-				tree.get<Pre>(node).statements.emplace_back(stmt);
+				tree.get_mut<Pre>(node).statements.emplace_back(stmt);
 			} while (peek_is_stmt(lex.peek()));
 		}
 
@@ -567,7 +671,7 @@ namespace wpp {
 				last_is_expr = peek_is_expr(lex.peek());
 
 				const wpp::node_t stmt = statement(lex, tree);
-				tree.get<Block>(node).statements.emplace_back(stmt);
+				tree.get_mut<Block>(node).statements.emplace_back(stmt);
 			} while (peek_is_stmt(lex.peek()));
 		}
 
@@ -575,8 +679,8 @@ namespace wpp {
 		// was an expression then we can pop the last statement and use
 		// it as our trailing expression.
 		if (not peek_is_expr(lex.peek()) and last_is_expr) {
-			tree.get<Block>(node).expr = tree.get<Block>(node).statements.back();
-			tree.get<Block>(node).statements.pop_back();
+			tree.get_mut<Block>(node).expr = tree.get_mut<Block>(node).statements.back();
+			tree.get_mut<Block>(node).statements.pop_back();
 		}
 
 		else {
@@ -607,7 +711,7 @@ namespace wpp {
 
 
 		const auto expr = wpp::expression(lex, tree); // Consume test expression.
-		tree.get<Map>(node).expr = expr;
+		tree.get_mut<Map>(node).expr = expr;
 
 
 		if (lex.advance() != TOKEN_LBRACE)
@@ -626,7 +730,7 @@ namespace wpp {
 
 			const auto hand = wpp::expression(lex, tree);
 
-			tree.get<Map>(node).cases.emplace_back(std::pair{ arm, hand });
+			tree.get_mut<Map>(node).cases.emplace_back(std::pair{ arm, hand });
 		}
 
 
@@ -641,21 +745,44 @@ namespace wpp {
 				throw wpp::Exception{lex.position(), "expected expression."};
 
 			const auto default_case = wpp::expression(lex, tree);
-			tree.get<Map>(node).default_case = default_case;
+			tree.get_mut<Map>(node).default_case = default_case;
 		}
 
 		else {
-			tree.get<Map>(node).default_case = wpp::NODE_EMPTY;
+			tree.get_mut<Map>(node).default_case = wpp::NODE_EMPTY;
 		}
 
 
 		if (lex.advance() != TOKEN_RBRACE)
 			throw wpp::Exception{lex.position(), "expected '}'."};
 
+
+		wpp::index_map(node, tree);
+
 		return node;
 	}
 
 
+	void index_map(wpp::node_t node, wpp::AST& tree) {
+		auto& [test, cases, default_case, index, pos] = tree.get_mut<Map>(node);
+
+		const bool constant = std::all_of(cases.begin(), cases.end(), [&] (const auto& elem) {
+			return std::holds_alternative<String>(tree[elem.first]);
+		});
+
+		if (constant and not cases.empty()) {
+			Map::Index lookup;
+			lookup.reserve(cases.size());
+
+			// Earlier arms take priority so we don't overwrite duplicates.
+			for (size_t i = 0; i < cases.size(); ++i)
+				lookup.emplace(tree.get<String>(cases[i].first).value, i);
+
+			index = std::make_shared<const Map::Index>(std::move(lookup));
+		}
+	}
+
+
 	// Parse an expression.
 	wpp::node_t expression(wpp::Lexer& lex, wpp::AST& tree) {
 		// We use lhs to store the resulting expression
@@ -692,8 +819,8 @@ namespace wpp {
 
 			const wpp::node_t rhs = expression(lex, tree);
 
-			tree.get<Concat>(node).lhs = lhs;
-			tree.get<Concat>(node).rhs = rhs;
+			tree.get_mut<Concat>(node).lhs = lhs;
+			tree.get_mut<Concat>(node).rhs = rhs;
 
 			return node;
 		}
@@ -733,7 +860,7 @@ namespace wpp {
 		// Consume expressions until we encounter eof or an error.
 		while (lex.peek() != TOKEN_EOF) {
 			const wpp::node_t stmt = statement(lex, tree);
-			tree.get<Document>(node).stmts.emplace_back(stmt);
+			tree.get_mut<Document>(node).stmts.emplace_back(stmt);
 		}
 
 		return node;
@@ -4,6 +4,8 @@
 #define WOTPP_PARSER
 
 #include <string>
+#include <string_view>
+#include <vector>
 
 #include <frontend/token.hpp>
 #include <frontend/lexer/lexer.hpp>
@@ -80,6 +82,20 @@ namespace wpp {
 		;
 	}
 
+	// Check if the token is an escape sequence inside of a string.
+	inline bool peek_is_escape(const wpp::Token& tok) {
+		return
+			tok == TOKEN_ESCAPE_NEWLINE or
+			tok == TOKEN_ESCAPE_TAB or
+			tok == TOKEN_ESCAPE_CARRIAGERETURN or
+			tok == TOKEN_ESCAPE_QUOTE or
+			tok == TOKEN_ESCAPE_DOUBLEQUOTE or
+			tok == TOKEN_ESCAPE_BACKSLASH or
+			tok == TOKEN_ESCAPE_HEX or
+			tok == TOKEN_ESCAPE_BIN
+		;
+	}
+
 	// Check if the token is a statement.
 	inline bool peek_is_stmt(const wpp::Token& tok) {
 		return
@@ -95,8 +111,8 @@ namespace wpp {
 	void accumulate_string(const wpp::Token&, std::string&, bool = true);
 
 	// Forward declarations.
-	void normal_string(wpp::Lexer&, std::string&);
-	void stringify_string(wpp::Lexer&, std::string&);
+	std::string_view normal_string(wpp::Lexer&, std::string&);
+	std::string_view stringify_string(wpp::Lexer&);
 	void smart_string(wpp::Lexer&, std::string&);
 	void hex_string(wpp::Lexer&, std::string&);
 	void bin_string(wpp::Lexer&, std::string&);
@@ -119,6 +135,11 @@ namespace wpp {
 	wpp::node_t prefix(wpp::Lexer&, wpp::AST&);
 
 	wpp::node_t document(wpp::Lexer&, wpp::AST&);
+
+	void resolve_params(wpp::node_t, const std::vector<wpp::symbol_t>&, wpp::AST&);
+
+	// Build the index of a Map if every arm is a string literal.
+	void index_map(wpp::node_t, wpp::AST&);
 }
 
 #endif
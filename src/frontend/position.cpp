@@ -0,0 +1,295 @@
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <algorithm>
+#include <utility>
+#include <filesystem>
+#include <system_error>
+
+#include <cstring>
+#include <cerrno>
+
+#if defined(__unix__) || defined(__APPLE__)
+	#define WPP_MMAP
+
+	#include <sys/types.h>
+	#include <sys/stat.h>
+	#include <sys/mman.h>
+	#include <unistd.h>
+	#include <fcntl.h>
+#endif
+
+#include <frontend/position.hpp>
+
+
+namespace wpp {
+	// Files smaller than this are read instead of mapped. Every mapping
+	// costs a system call to undo and counts against the per-process limit
+	// on mappings, which isn't worth it to save copying a few pages.
+	constexpr size_t MAP_MIN_SIZE = 16 * 1024;
+
+
+	Source::Source(std::string contents): owned(std::move(contents)) {
+		length = owned.size();
+		owned.append(wpp::FILE_PADDING, '\0');
+		ptr = owned.c_str();
+	}
+
+
+	Source::Source(Source&& other) noexcept {
+		*this = std::move(other);
+	}
+
+
+	Source& Source::operator=(Source&& other) noexcept {
+		if (this == &other)
+			return *this;
+
+		unmap();
+
+		// Borrowed contents belong to neither string nor mapping.
+		const bool borrowed = not other.mapping and other.owned.empty();
+		const char* const borrowed_ptr = other.ptr;
+
+		owned = std::move(other.owned);
+		mapping = std::exchange(other.mapping, nullptr);
+		mapped = std::exchange(other.mapped, 0);
+		length = std::exchange(other.length, 0);
+
+		// Moving a string can move its buffer so we can't just copy the pointer.
+		ptr = mapping ? static_cast<const char*>(mapping) : borrowed ? borrowed_ptr : owned.c_str();
+		other.ptr = nullptr;
+
+		return *this;
+	}
+
+
+	Source::~Source() {
+		unmap();
+	}
+
+
+	void Source::unmap() {
+		#if defined(WPP_MMAP)
+			if (mapping)
+				munmap(mapping, mapped);
+		#endif
+
+		mapping = nullptr;
+		mapped = 0;
+	}
+
+
+	Source Source::map(std::string_view path) {
+		const std::string fname{path};
+
+		const auto fail = [&] (const char* what) {
+			throw std::filesystem::filesystem_error{
+				what, fname, std::error_code{ errno, std::generic_category() }
+			};
+		};
+
+		#if defined(WPP_MMAP)
+			const int fd = open(fname.c_str(), O_RDONLY | O_CLOEXEC);
+
+			if (fd == -1)
+				fail("cannot open file");
+
+			struct stat info;
+
+			if (fstat(fd, &info) == -1) {
+				close(fd);
+				fail("cannot stat file");
+			}
+
+			// Only regular files can be mapped.
+			if (S_ISREG(info.st_mode) and static_cast<size_t>(info.st_size) >= MAP_MIN_SIZE) {
+				const size_t size = info.st_size;
+				const size_t page = sysconf(_SC_PAGESIZE);
+				const size_t mapped = (size + wpp::FILE_PADDING + page - 1) / page * page;
+
+				// Reserve zeroed memory big enough for the file and its padding
+				// and then map the file over the start of it. The kernel zeroes
+				// the rest of the last page of the file so the padding is
+				// always made of NUL bytes, even when the file fills its page.
+				void* region = mmap(nullptr, mapped, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+				if (region != MAP_FAILED) {
+					if (mmap(region, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED) {
+						close(fd);
+
+						madvise(region, size, MADV_SEQUENTIAL);
+
+						Source src;
+
+						src.mapping = region;
+						src.mapped = mapped;
+						src.ptr = static_cast<const char*>(region);
+						src.length = size;
+
+						return src;
+					}
+
+					munmap(region, mapped);
+				}
+			}
+
+			// Fall back to reading the file.
+			std::string contents;
+
+			if (S_ISREG(info.st_mode))
+				contents.reserve(info.st_size + wpp::FILE_PADDING);
+
+			char buf[64 * 1024];
+			ssize_t n;
+
+			while ((n = read(fd, buf, sizeof(buf))) != 0) {
+				if (n == -1 and errno == EINTR)
+					continue;
+
+				if (n == -1) {
+					close(fd);
+					fail("cannot read file");
+				}
+
+				contents.append(buf, n);
+			}
+
+			close(fd);
+
+			return Source{ std::move(contents) };
+
+		#else
+			std::FILE* fp = std::fopen(fname.c_str(), "rb");
+
+			if (not fp)
+				fail("cannot open file");
+
+			std::string contents;
+
+			char buf[64 * 1024];
+			size_t n;
+
+			while ((n = std::fread(buf, 1, sizeof(buf), fp)) > 0)
+				contents.append(buf, n);
+
+			std::fclose(fp);
+
+			return Source{ std::move(contents) };
+		#endif
+	}
+
+
+	Source Source::borrow(std::string_view contents) {
+		Source src;
+
+		src.owned.clear();
+		src.ptr = contents.data();
+		src.length = contents.size();
+
+		return src;
+	}
+
+
+	struct File {
+		std::string path;
+		wpp::Source contents;
+
+		// Byte offset of the start of every line, built lazily.
+		std::vector<uint32_t> lines{};
+		bool indexed = false;
+	};
+
+
+	// The file table. A deque is used so that references to existing
+	// files stay valid when new ones are added.
+	// ID 0 is reserved for positions that don't belong to any file.
+	std::deque<File> files(1);
+	std::mutex files_mutex;
+
+	// IDs of released files, reused before the table grows.
+	std::vector<wpp::file_id_t> released;
+
+
+	wpp::file_id_t add_file(const std::string& path, wpp::Source contents) {
+		std::lock_guard lock{files_mutex};
+
+		if (not released.empty()) {
+			const wpp::file_id_t file = released.back();
+			released.pop_back();
+
+			files[file] = { path, std::move(contents) };
+			return file;
+		}
+
+		files.push_back({ path, std::move(contents) });
+		return files.size() - 1;
+	}
+
+
+	void release_file(wpp::file_id_t file) {
+		std::lock_guard lock{files_mutex};
+
+		files[file] = {};
+		released.emplace_back(file);
+	}
+
+
+	// Entries never move because the table is a deque, so the lock only
+	// has to cover the lookup. An entry stays valid while its ID is live:
+	// it is only cleared by `release_file`, after which `add_file` may
+	// reuse the ID for a different file.
+	const File& get_file(wpp::file_id_t file) {
+		std::lock_guard lock{files_mutex};
+		return files[file];
+	}
+
+
+	const std::string& file_path(wpp::file_id_t file) {
+		return get_file(file).path;
+	}
+
+
+	const char* file_contents(wpp::file_id_t file) {
+		return get_file(file).contents.data();
+	}
+
+
+	std::string_view file_view(wpp::file_id_t file) {
+		return get_file(file).contents.view();
+	}
+
+
+	wpp::Coord resolve(const wpp::Position& pos) {
+		std::lock_guard lock{files_mutex};
+
+		auto& [path, contents, lines, indexed] = files[pos.file];
+
+		// Build the line-start index.
+		if (not indexed) {
+			lines.emplace_back(0);
+
+			const char* const begin = contents.data();
+			const char* const end = begin + contents.size();
+
+			for (const char* ptr = begin; (ptr = static_cast<const char*>(std::memchr(ptr, '\n', end - ptr))); ++ptr)
+				lines.emplace_back(ptr - begin + 1);
+
+			indexed = true;
+		}
+
+		Coord coord;
+
+		coord.path = path;
+		coord.eof = pos.offset >= contents.size() or contents.data()[pos.offset] == '\0';
+
+		// Find the last line that starts at or before our offset.
+		const auto it = std::upper_bound(lines.begin(), lines.end(), pos.offset) - 1;
+
+		coord.line = it - lines.begin() + 1;
+		coord.column = pos.offset - *it + 1;
+
+		return coord;
+	}
+}
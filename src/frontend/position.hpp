@@ -5,62 +5,99 @@
 
 #include <iostream>
 #include <string>
+#include <string_view>
+
+#include <cstdint>
+#include <cstddef>
 
 // Track a position in a source file.
-// Calculated as needed when an error occurs.
+// A position is just a file ID and a byte offset, line and column are
+// calculated as needed when an error occurs.
 
 namespace wpp {
+	using file_id_t = uint32_t;
+
 	struct Position {
+		wpp::file_id_t file = 0;
+		uint32_t offset = 0;
+	};
+
+
+	// A position resolved to line and column.
+	struct Coord {
 		std::string path;
-		const char* msg = nullptr;
 		int line = 1, column = 1;
+		bool eof = false;
 	};
 
 
-	inline std::ostream& operator<<(std::ostream& os, const Position& pos) {
-		const auto& [fname, msg, line, column] = pos;
+	// Every file in the table is followed by this many NUL bytes so that
+	// the lexer can read ahead in blocks without checking for the end.
+	constexpr size_t FILE_PADDING = 64;
 
-		if (msg)
-			return (os << fname << ':' << msg);
+	// Contents of a source file followed by FILE_PADDING NUL bytes.
+	// Large files on disk are mapped into memory where we can so that
+	// they aren't copied, anything else is kept in a string unless it is
+	// borrowed.
+	class Source {
+		std::string owned{};
+		void* mapping = nullptr;
+		size_t mapped = 0;
 
-		else
-			return (os << fname << ':' << line << ':' << column);
-	}
+		const char* ptr = nullptr;
+		size_t length = 0;
+
+		void unmap();
 
+		public:
+			Source(std::string contents = "");
 
-	inline Position position(
-		const std::string& fname,
-		const char* ptr,
-		const char* const end,
-		int line_offset = 0,
-		int column_offset = 0
-	) {
-		Position coord;
-		auto& [path, msg, line, column] = coord;
+			Source(Source&&) noexcept;
+			Source& operator=(Source&&) noexcept;
+			~Source();
 
-		path = fname;
+			const char* data() const { return ptr; }
+			size_t size() const { return length; }  // Size without the padding.
 
-		while (ptr != end) {
-			if (*ptr == '\n') {
-				column = 1;
-				line++;
-			}
+			std::string_view view() const { return { ptr, length }; }
 
-			else {
-				column++;
-			}
+			// Map a file or read it if it is small or can't be mapped (pipes).
+			// Throws std::filesystem::filesystem_error if it can't be opened.
+			static Source map(std::string_view path);
 
-			++ptr;
-		}
+			// Refer to contents owned by something that outlives the source,
+			// e.g. another file in the table. They must already be followed
+			// by the padding.
+			static Source borrow(std::string_view contents);
+	};
+
+
+	// Register a source file and get back its ID.
+	// The file table owns the contents for the rest of the program so
+	// that they can be used to resolve positions later on.
+	wpp::file_id_t add_file(const std::string& path, wpp::Source contents);
+
+	// Give back a file that nothing refers to any more so that its
+	// contents are freed and its ID can be reused by `add_file`.
+	void release_file(wpp::file_id_t file);
+
+	const std::string& file_path(wpp::file_id_t file);
+	const char* file_contents(wpp::file_id_t file);
+	std::string_view file_view(wpp::file_id_t file);  // Contents without the padding.
 
-		if (*ptr == '\0') {
-			msg = "EOF";
-		}
+	// Resolve a position to line and column. The line-start index of a file
+	// is built the first time one of its positions is resolved.
+	wpp::Coord resolve(const wpp::Position& pos);
 
-		line += line_offset;
-		column += column_offset;
 
-		return coord;
+	inline std::ostream& operator<<(std::ostream& os, const Position& pos) {
+		const auto& [path, line, column, eof] = wpp::resolve(pos);
+
+		if (eof)
+			return (os << path << ":EOF");
+
+		else
+			return (os << path << ':' << line << ':' << column);
 	}
 }
 
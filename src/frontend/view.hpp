@@ -4,6 +4,7 @@
 #define WOTPP_VIEW
 
 #include <string>
+#include <string_view>
 #include <iostream>
 
 #include <cstring>
@@ -86,6 +87,10 @@ namespace wpp {
 		std::string str() const {
 			return std::string{ ptr, static_cast<std::string::size_type>(length) };
 		}
+
+		constexpr std::string_view str_view() const {
+			return std::string_view{ ptr, length };
+		}
 	};
 
 	inline std::ostream& operator<<(std::ostream& os, const View& v) {
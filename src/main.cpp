@@ -1,14 +1,24 @@
 #include <string>
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <utility>
 #include <chrono>
+#include <charconv>
+#include <vector>
+#include <optional>
+#include <algorithm>
+#include <filesystem>
+#include <thread>
+#include <atomic>
 
 #include <cstdint>
 #include <cstring>
 #include <ctime>
 
+#include <wpp.hpp>
 #include <misc/warnings.hpp>
-#include <backend/eval/eval.hpp>
+#include <misc/util/util.hpp>
 #include <misc/repl.hpp>
 #include <misc/argp.hpp>
 
@@ -17,10 +27,38 @@ constexpr auto ver = "alpha-git";
 constexpr auto desc = "A small macro language for producing and manipulating strings.";
 
 
+// Result of rendering one of the files named on the command line.
+// Failures are kept until every file is done so that they can be
+// reported in input order, along with the warnings and logs of every
+// file when they are rendered on more than one thread.
+struct Render {
+	std::string out;
+	std::filesystem::path target;  // Empty unless writing to --output-dir.
+	std::vector<std::filesystem::path> inputs;
+
+	std::ostringstream diagnostics;
+
+	std::optional<wpp::RenderError> error;
+	bool missing = false;
+};
+
+
 int main(int argc, const char* argv[]) {
 	std::string_view outputf;
+	std::string_view output_dir;
 	std::vector<std::string_view> warnings;
 	bool repl = false;
+	bool vm = false;
+	bool stream = false;
+	bool direct_exec = false;
+	std::string_view jobs_arg;
+	std::string_view run_cache;
+	std::string_view run_cache_salt;
+	std::string_view depfile;
+	bool source_once = false;
+	std::vector<std::string_view> preludes;
+	std::string_view dump_image;
+	std::string_view load_image;
 
 
 	std::vector<const char*> positional;
@@ -28,9 +66,21 @@ int main(int argc, const char* argv[]) {
 	if (wpp::argparser(
 		wpp::Meta{ver, desc},
 		argc, argv, &positional,
-		wpp::Opt{outputf,  "output file",       "--output",   "-o"},
-		wpp::Opt{repl,     "repl mode",         "--repl",     "-R"},
-		wpp::Opt{warnings, "toggle warnings",   "--warnings", "-W"}
+		wpp::Opt{outputf,        "output file",                            "--output",         "-o"},
+		wpp::Opt{output_dir,     "output directory",                       "--output-dir",     "-O"},
+		wpp::Opt{repl,           "repl mode",                              "--repl",           "-R"},
+		wpp::Opt{vm,             "use bytecode vm",                        "--vm",             "-b"},
+		wpp::Opt{stream,         "stream output",                          "--stream",         "-s"},
+		wpp::Opt{direct_exec,    "run without shell",                      "--direct-exec",    "-x"},
+		wpp::Opt{jobs_arg,       "concurrent runs (only files with --vm)", "--jobs",           "-j"},
+		wpp::Opt{run_cache,      "cache run results",                      "--run-cache",      "-C"},
+		wpp::Opt{run_cache_salt, "salt for run cache",                     "--run-cache-salt", "-S"},
+		wpp::Opt{depfile,        "write dependencies",                     "--depfile",        "-M"},
+		wpp::Opt{source_once,    "source files once",                      "--source-once",    "-1"},
+		wpp::Opt{preludes,       "load before files",                      "--prelude",        "-p"},
+		wpp::Opt{dump_image,     "save preludes",                          "--dump-image",     "-d"},
+		wpp::Opt{load_image,     "load saved preludes",                    "--load-image",     "-i"},
+		wpp::Opt{warnings,       "toggle warnings",                        "--warnings",       "-W"}
 	))
 		return 0;
 
@@ -60,55 +110,283 @@ int main(int argc, const char* argv[]) {
 	}
 
 
+	size_t jobs = 1;
+
+	if (not jobs_arg.empty()) {
+		const auto [ptr, ec] = std::from_chars(jobs_arg.data(), jobs_arg.data() + jobs_arg.size(), jobs);
+
+		if (ec != std::errc{} or ptr != jobs_arg.data() + jobs_arg.size() or jobs == 0) {
+			std::cerr << "invalid number of jobs: '" << jobs_arg << "'.\n";
+			return 1;
+		}
+	}
+
+
+	// The depfile names the output as its target.
+	if (not depfile.empty() and outputf.empty()) {
+		std::cerr << "--depfile requires --output.\n";
+		return 1;
+	}
+
+	if (not outputf.empty() and not output_dir.empty()) {
+		std::cerr << "--output and --output-dir can't be used together.\n";
+		return 1;
+	}
+
+
 	if (repl)
 		return wpp::repl();
 
 
-	if (positional.empty()) {
+	if (not dump_image.empty() and preludes.empty() and load_image.empty()) {
+		std::cerr << "--dump-image requires --prelude or --load-image.\n";
+		return 1;
+	}
+
+	// Dumping an image doesn't need anything to render.
+	if (positional.empty() and dump_image.empty()) {
 		std::cerr << "no input files.\n";
 		return 1;
 	}
 
 
-	std::string out;
 	const auto initial_path = std::filesystem::current_path();
 
-	for (const auto& fname: positional) {
+	const auto run_cache_path = run_cache.empty() ?
+		std::filesystem::path{} : std::filesystem::absolute(run_cache);
+
+	const auto output_path = output_dir.empty() ?
+		std::filesystem::path{} : std::filesystem::absolute(output_dir);
+
+	// When streaming, the output of every top-level statement is written
+	// to the sink as soon as it has been evaluated instead of collecting
+	// the whole document in memory first.
+	std::ofstream outputfs;
+
+	if (stream and not outputf.empty())
+		outputfs.open(outputf.data());
+
+	std::ostream& sink = outputf.empty() ? std::cout : outputfs;
+
+	// Files are rendered on up to `jobs` threads, each with its own
+	// environment. Runs inside a file share whatever is left over so that
+	// we never have many more than `jobs` things going at once.
+	// Streaming into a single output has to happen in order so it
+	// renders one file at a time.
+	const size_t threads = (stream and output_path.empty()) ?
+		1 : std::min(jobs, std::max<size_t>(1, positional.size()));
+
+	const size_t runs = std::max<size_t>(1, jobs / threads);
+
+	// With --output-dir, `pages/index.html.wpp` is written to
+	// `<dir>/pages/index.html`. Files outside of the working directory
+	// go straight into the output directory.
+	const auto output_for = [&] (const std::filesystem::path& path) {
+		auto rel = path.lexically_relative(initial_path);
+
+		if (rel.empty() or *rel.begin() == "..")
+			rel = path.filename();
+
+		if (rel.extension() == ".wpp")
+			rel.replace_extension();
+
+		return output_path / rel;
+	};
+
+	std::vector<Render> renders(positional.size());
+
+	wpp::Options options;
+
+	options.vm = vm;
+	options.warnings = warning_flags;
+	options.direct_exec = direct_exec;
+	options.jobs = runs;
+	options.run_cache = run_cache_path;
+	options.run_cache_salt = run_cache_salt;
+	options.source_once = source_once;
+
+	// Preludes are rendered once and then every file is rendered in a
+	// fork of them so that they don't have to be parsed and evaluated
+	// again for each file. An image saves having to do even that once.
+	std::optional<wpp::Context> prelude;
+
+	if (not load_image.empty()) {
 		try {
-			std::string file = wpp::read_file(fname);
+			prelude = wpp::Context::from_image(std::string{load_image}, initial_path, options);
+		}
+
+		catch (const std::filesystem::filesystem_error&) {
+			std::cerr << "file '" << load_image << "' not found.\n";
+			return 1;
+		}
+
+		catch (const std::runtime_error& e) {
+			std::cerr << e.what() << '\n';
+			return 1;
+		}
+	}
 
-			// Set current path to path of file.
-			const auto path = std::filesystem::current_path() / std::filesystem::path{fname};
-			std::filesystem::current_path(path.parent_path());
+	if (not preludes.empty()) {
+		if (not prelude)
+			prelude.emplace(initial_path, options);
 
-			wpp::Lexer lex{std::filesystem::relative(path, initial_path), file.c_str()};
-			wpp::AST tree;
-			wpp::Environment env{initial_path, tree, warning_flags};
+		for (const auto& fname: preludes) {
+			try {
+				prelude->load(std::string{fname});
+			}
 
-			tree.reserve((1024 * 1024 * 10) / sizeof(decltype(tree)::value_type));
+			catch (const wpp::RenderError& e) {
+				std::cerr << e << '\n';
+				return 1;
+			}
 
-			auto root = wpp::document(lex, tree);
-			out += wpp::eval_ast(root, env) + "\n";
+			catch (const std::filesystem::filesystem_error&) {
+				std::cerr << "file '" << fname << "' not found.\n";
+				return 1;
+			}
 		}
 
-		catch (const wpp::Exception& e) {
-			wpp::error(e.pos, e.what());
+		prelude->freeze();
+	}
+
+	if (not dump_image.empty()) {
+		try {
+			prelude->dump_image(std::string{dump_image});
+		}
+
+		catch (const std::filesystem::filesystem_error&) {
+			std::cerr << "cannot write image '" << dump_image << "'.\n";
 			return 1;
 		}
 
-		catch (const std::filesystem::filesystem_error& e) {
-			std::cerr << "file '" << fname << "' not found.\n";
+		if (positional.empty())
+			return 0;
+	}
+
+	const auto render = [&] (size_t i) {
+		auto& [out, target, inputs, diagnostics, error, missing] = renders[i];
+
+		const auto path = (initial_path / std::filesystem::path{positional[i]}).lexically_normal();
+
+		if (not output_path.empty())
+			target = output_for(path);
+
+		std::ofstream filefs;
+
+		// The output file is only created once the input has been read.
+		const auto open = [&] () -> std::ostream& {
+			if (target.empty())
+				return sink;
+
+			if (not filefs.is_open()) {
+				std::filesystem::create_directories(target.parent_path());
+				filefs.open(target);
+			}
+
+			return filefs;
+		};
+
+		wpp::Context::Flush flush;
+
+		if (stream) {
+			flush = [&] (std::string& str) {
+				open() << str << std::flush;
+				str.clear();
+			};
+		}
+
+		try {
+			wpp::Options opts = options;
+			opts.diagnostics = threads == 1 ? &std::cerr : &diagnostics;
+
+			wpp::Context context = prelude ?
+				prelude->fork(opts) : wpp::Context{initial_path, opts};
+
+			context.render_file(path, out, flush);
+
+			out += "\n";
+
+			if (stream)
+				flush(out);
+
+			inputs = context.inputs();
+		}
+
+		catch (const wpp::RenderError& e) {
+			error = e;
+		}
+
+		catch (const std::filesystem::filesystem_error&) {
+			missing = true;
+		}
+
+		return not error and not missing;
+	};
+
+	// Once a file fails we stop starting new ones, but every file before
+	// it has already been started so the first failure in input order is
+	// always found.
+	std::atomic<size_t> next = 0;
+	std::atomic<bool> failed = false;
+
+	const auto worker = [&] {
+		for (size_t i; not failed and (i = next++) < renders.size();)
+			if (not render(i))
+				failed = true;
+	};
+
+	std::vector<std::thread> pool;
+
+	for (size_t i = 1; i < threads; ++i)
+		pool.emplace_back(worker);
+
+	worker();
+
+	for (auto& thread: pool)
+		thread.join();
+
+
+	// Every file read while rendering, for the depfile.
+	std::vector<std::filesystem::path> inputs;
+
+	for (size_t i = 0; i < renders.size(); ++i) {
+		const auto& r = renders[i];
+
+		std::cerr << r.diagnostics.str();
+
+		if (r.error) {
+			std::cerr << *r.error << '\n';
 			return 1;
 		}
 
-		std::filesystem::current_path(initial_path);
+		if (r.missing) {
+			std::cerr << "file '" << positional[i] << "' not found.\n";
+			return 1;
+		}
+
+		inputs.insert(inputs.end(), r.inputs.begin(), r.inputs.end());
 	}
 
-	if (not outputf.empty())
-		wpp::write_file(outputf, out);
+	// Nothing is written until every file has worked. Streamed output
+	// has already been written by now, so a failure leaves whatever the
+	// files before it produced.
+	if (not stream) {
+		if (not outputf.empty())
+			outputfs.open(outputf.data());
+
+		for (const auto& r: renders) {
+			if (r.target.empty()) {
+				sink << r.out;
+				continue;
+			}
+
+			std::filesystem::create_directories(r.target.parent_path());
+			std::ofstream{ r.target } << r.out;
+		}
+	}
 
-	else
-		std::cout << out;
+	if (not depfile.empty())
+		wpp::write_depfile(depfile, outputf, inputs, initial_path);
 
 
 	return 0;
@@ -194,7 +194,7 @@ namespace wpp {
 	// Concatenate a variadic pack of strings to an out parameter.
 	template <typename... Ts>
 	inline void cat(std::string& out, Ts&&... strings) {
-		out.reserve(out.capacity() + sizeof...(Ts) * (sizeof(void*) * 2));
+		out.reserve(out.size() + sizeof...(Ts) * (sizeof(void*) * 2));
 		((out += strings), ...);
 	}
 
@@ -223,7 +223,7 @@ namespace wpp {
 	template <typename T>
 	inline void option_doc_second_column(std::string& str, const Opt<T>& opt, int padding) {
 		const auto& [ref, desc, lng, shrt] = opt;
-		str.reserve(str.capacity() + padding + std::strlen(desc) + 1);
+		str.reserve(str.size() + padding + std::strlen(desc) + 1);
 
 		// using RefT = std::remove_reference_t<std::remove_cv_t<decltype(ref)>>;
 
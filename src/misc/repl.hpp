@@ -11,14 +11,7 @@
 	#include <cstdlib>
 #endif
 
-#include <misc/util/util.hpp>
-#include <structures/exception.hpp>
-
-#include <frontend/lexer/lexer.hpp>
-#include <frontend/parser/parser.hpp>
-
-#include <backend/sexpr/sexpr.hpp>
-#include <backend/eval/eval.hpp>
+#include <wpp.hpp>
 
 namespace wpp {
 	inline int repl() {
@@ -27,11 +20,7 @@ namespace wpp {
 			return 1;
 
 		#else
-			wpp::AST tree;
-			wpp::Environment env{std::filesystem::current_path(), tree};
-
-			// Reserve 10MiB
-			tree.reserve((1024 * 1024 * 10) / sizeof(decltype(tree)::value_type));
+			wpp::Context context{std::filesystem::current_path()};
 
 			std::cout << "wot++ repl\n";
 
@@ -45,23 +34,18 @@ namespace wpp {
 
 				add_history(input);
 
-				// Create a new lexer.
-				wpp::Lexer lex{"<repl>", input};
-
 				try {
-					// Parse.
-					auto root = document(lex, tree);
+					std::string out;
+					context.render(input, out, "<repl>");
 
-					// Evaluate.
-					const auto out = wpp::eval_ast(root, env);
 					std::cout << out << std::flush;
 
 					if (out.size() && out[out.size() - 1] != '\n')
 						std::cout << std::endl;
 				}
 
-				catch (const wpp::Exception& e) {
-					wpp::error(e.pos, e.what());
+				catch (const wpp::RenderError& e) {
+					std::cerr << e << '\n';
 				}
 
 				std::free(input);
@@ -0,0 +1,152 @@
+#include <string>
+#include <string_view>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <atomic>
+#include <system_error>
+
+#include <cstdio>
+#include <cinttypes>
+
+#if !defined(WPP_DISABLE_RUN)
+	#include <unistd.h>
+#endif
+
+#include <misc/util/util.hpp>
+#include <misc/run_cache/run_cache.hpp>
+
+
+namespace wpp {
+	// Bump this if the format of entries changes.
+	constexpr std::string_view cache_magic = "wpp-run-cache 3\n";
+
+
+	wpp::RunKey run_key(
+		const std::string& cmd,
+		const std::string* input,
+		const std::filesystem::path& dir,
+		const std::string& salt
+	) {
+		wpp::RunKey key{ cmd, dir.string(), salt };
+
+		if (input) {
+			key.piped = true;
+			key.input = *input;
+		}
+
+		return key;
+	}
+
+
+	// The header line of an entry, followed by the command, directory,
+	// salt, input and output.
+	std::string cache_header(const wpp::RunKey& key, int rc, size_t output_size) {
+		std::ostringstream ss;
+
+		ss << key.piped << ' ' << rc << ' ' << key.cmd.size() << ' ' << key.dir.size() << ' '
+			<< key.salt.size() << ' ' << key.input.size() << ' ' << output_size << '\n';
+
+		return ss.str();
+	}
+
+
+	// Entries are named by a hash of everything in the key. Sizes are
+	// included so that the fields can't run into each other.
+	std::filesystem::path cache_entry(const std::filesystem::path& dir, const wpp::RunKey& key) {
+		std::string str = cache_header(key, 0, 0);
+		str += key.cmd;
+		str += key.dir;
+		str += key.salt;
+		str += key.input;
+
+		char name[17];
+		std::snprintf(name, sizeof(name), "%016" PRIx64, wpp::hash_bytes(str.data(), str.data() + str.size()));
+
+		return dir / name;
+	}
+
+
+	bool cache_load(const std::filesystem::path& dir, const wpp::RunKey& key, std::string& output, int& rc) {
+		std::ifstream is{ cache_entry(dir, key), std::ios::binary };
+
+		if (not is)
+			return false;
+
+		std::string magic(cache_magic.size(), '\0');
+
+		if (not is.read(magic.data(), magic.size()) or magic != cache_magic)
+			return false;
+
+		bool piped = false;
+		size_t cmd_size = 0, dir_size = 0, salt_size = 0, input_size = 0, output_size = 0;
+		int status = 0;
+
+		if (not (is >> piped >> status >> cmd_size >> dir_size >> salt_size >> input_size >> output_size) or is.get() != '\n')
+			return false;
+
+		if (
+			piped != key.piped or
+			cmd_size != key.cmd.size() or
+			dir_size != key.dir.size() or
+			salt_size != key.salt.size() or
+			input_size != key.input.size()
+		)
+			return false;
+
+		const size_t key_size = cmd_size + dir_size + salt_size + input_size;
+		std::string str(key_size + output_size, '\0');
+
+		// The entry has to end exactly where the header says it does.
+		if (not is.read(str.data(), str.size()) or is.peek() != std::char_traits<char>::eof())
+			return false;
+
+		// Everything but the output is the key we wrote the entry for.
+		if (str.compare(0, key_size, key.cmd + key.dir + key.salt + key.input) != 0)
+			return false;
+
+		output = str.substr(key_size);
+		rc = status;
+
+		return true;
+	}
+
+
+	void cache_store(const std::filesystem::path& dir, const wpp::RunKey& key, const std::string& output, int rc) {
+		#if !defined(WPP_DISABLE_RUN)
+			static std::atomic<uint64_t> counter = 0;
+
+			std::error_code ec;
+			std::filesystem::create_directories(dir, ec);
+
+			const auto entry = cache_entry(dir, key);
+
+			// The temporary name has to be unique across processes sharing
+			// the cache as well as threads in this one.
+			auto tmp = entry;
+			tmp += wpp::cat(".tmp.", static_cast<long>(getpid()), ".", static_cast<unsigned long long>(counter++));
+
+			{
+				std::ofstream os{ tmp, std::ios::binary };
+
+				os << cache_magic << cache_header(key, rc, output.size()) << key.cmd << key.dir << key.salt << key.input << output;
+
+				if (not os.flush()) {
+					os.close();
+					std::filesystem::remove(tmp, ec);
+					return;
+				}
+			}
+
+			std::filesystem::rename(tmp, entry, ec);
+
+			if (ec)
+				std::filesystem::remove(tmp, ec);
+		#else
+			(void)dir;
+			(void)key;
+			(void)output;
+			(void)rc;
+		#endif
+	}
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#ifndef WOTPP_RUN_CACHE
+#define WOTPP_RUN_CACHE
+
+#include <string>
+#include <filesystem>
+
+#include <cstdint>
+
+// On-disk cache of the results of run and pipe.
+// Entries are named by a hash of the command, its input and a salt chosen
+// by the user and hold all three along with the output and exit status of
+// the command, a hit has to match every one of them exactly.
+// Entries are written to a temporary file and renamed into place so
+// that concurrent builds sharing a cache never see partial entries.
+
+namespace wpp {
+	// Everything that identifies a command.
+	struct RunKey {
+		std::string cmd;
+		std::string dir;  // Directory the command runs in.
+		std::string salt;
+		bool piped = false;  // pipe with input rather than run.
+		std::string input{};
+	};
+
+	wpp::RunKey run_key(
+		const std::string& cmd,
+		const std::string* input,
+		const std::filesystem::path& dir,
+		const std::string& salt
+	);
+
+	// Look up a command, returns whether it was found. Entries that don't
+	// match the key exactly (a collision of their names) or are damaged are misses.
+	bool cache_load(const std::filesystem::path& dir, const wpp::RunKey& key, std::string& output, int& rc);
+
+	// Store the result of a command that succeeded. Failing to write is
+	// not an error, the command will just run again next time.
+	void cache_store(const std::filesystem::path& dir, const wpp::RunKey& key, const std::string& output, int rc);
+}
+
+#endif
@@ -1,11 +1,20 @@
 #include <string>
 #include <filesystem>
 #include <fstream>
+#include <string_view>
+#include <vector>
+#include <unordered_set>
 #include <array>
+#include <utility>
+#include <algorithm>
 #include <stdexcept>
 
 #include <cstdint>
 #include <cstdio>
+#include <cerrno>
+
+#include <frontend/position.hpp>
+#include <misc/util/util.hpp>
 
 
 #if !defined(WPP_DISABLE_RUN)
@@ -15,6 +24,17 @@
 	#include <unistd.h>
 	#include <fcntl.h>
 	#include <dlfcn.h>
+	#include <poll.h>
+	#include <spawn.h>
+	#include <signal.h>
+	#include <pthread.h>
+
+	// posix_spawn can change the directory of the child itself.
+	#if (defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))) || defined(__APPLE__)
+		#define WPP_SPAWN_CHDIR
+	#endif
+
+	extern char** environ;
 #endif
 
 
@@ -39,103 +59,408 @@ namespace wpp {
 	}
 
 
-	// Execute a shell command, capture its standard output and return it
-	// https://stackoverflow.com/questions/478898/how-do-i-execute-a-command-and-get-the-output-of-the-command-within-c-using-po
-	std::string exec(const std::string& cmd, int& rc) {
-		#if !defined(WPP_DISABLE_RUN)
-			std::array<char, 128> buffer;
-			std::string result;
+	#if !defined(WPP_DISABLE_RUN)
+		// Create a pipe whose ends aren't inherited by other children.
+		bool cloexec_pipe(int fds[2]) {
+			#if defined(__linux__)
+				return pipe2(fds, O_CLOEXEC) == 0;
+			#else
+				if (pipe(fds) != 0)
+					return false;
+
+				fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+				fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+				return true;
+			#endif
+		}
+
+
+		// Write to a child without being killed by SIGPIPE if it has stopped
+		// reading. The signal is blocked for this thread only and taken back
+		// out if the write raised it, signal handling is left alone for the
+		// rest of the process, which may be a program embedding us.
+		ssize_t write_child(int fd, const char* data, size_t size) {
+			sigset_t sigpipe, old, pending;
+			sigemptyset(&sigpipe);
+			sigaddset(&sigpipe, SIGPIPE);
+
+			pthread_sigmask(SIG_BLOCK, &sigpipe, &old);
 
-			FILE* pipe = popen(cmd.c_str(), "r");
+			// A SIGPIPE that was already pending isn't ours to take.
+			sigpending(&pending);
+			const bool was_pending = sigismember(&pending, SIGPIPE);
 
-			if (not pipe) {
-				throw std::runtime_error("popen() failed!");
+			const ssize_t n = write(fd, data, size);
+			const int err = errno;
+
+			if (n == -1 and err == EPIPE and not was_pending) {
+				int sig = 0;
+				sigpending(&pending);
+
+				if (sigismember(&pending, SIGPIPE))
+					sigwait(&sigpipe, &sig);
 			}
 
-			while (not std::feof(pipe)) {
-				if (std::fgets(buffer.data(), buffer.size(), pipe) != nullptr)
-					result += buffer.data();
+			pthread_sigmask(SIG_SETMASK, &old, nullptr);
+
+			errno = err;
+			return n;
+		}
+
+
+		// Characters that mean a command has to go through the shell.
+		constexpr std::string_view shell_metachars = "|&;<>()$`\\\"' \t\n*?[]#~={}!";
+
+		// Builtins that only exist inside the shell or that change the
+		// shell itself, there's no program to spawn for these.
+		constexpr std::array<std::string_view, 29> shell_builtins = {
+			".", ":", "alias", "bg", "break", "cd", "command", "continue",
+			"eval", "exec", "exit", "export", "fc", "fg", "getopts", "hash",
+			"jobs", "read", "readonly", "return", "set", "shift", "times",
+			"trap", "type", "ulimit", "umask", "unalias", "unset",
+		};
+
+		// Split a command that doesn't need the shell into arguments.
+		// Returns nothing if it contains any shell syntax or starts with
+		// a shell builtin.
+		std::vector<std::string> split_command(const std::string& cmd) {
+			std::vector<std::string> args;
+
+			size_t i = 0;
+
+			while (i < cmd.size()) {
+				if (cmd[i] == ' ' or cmd[i] == '\t') {
+					++i;
+					continue;
+				}
+
+				const size_t end = std::min(cmd.find_first_of(shell_metachars, i), cmd.size());
+
+				if (end != cmd.size() and cmd[end] != ' ' and cmd[end] != '\t')
+					return {};
+
+				args.emplace_back(cmd, i, end - i);
+				i = end;
 			}
 
-			rc = pclose(pipe);
+			if (args.empty())
+				return {};
 
-			return result;
-		#else
-			(void)cmd;  // Hide "unused" warnings.
-			(void)rc;
+			const auto builtin = std::find(shell_builtins.begin(), shell_builtins.end(), args.front());
+
+			if (builtin != shell_builtins.end())
+				return {};
+
+			return args;
+		}
+
+
+	#endif
+
+
+	Process::Process(Process&& other) noexcept {
+		*this = std::move(other);
+	}
+
+
+	Process& Process::operator=(Process&& other) noexcept {
+		if (this == &other)
+			return *this;
+
+		this->close();
+
+		pid = std::exchange(other.pid, -1);
+		in = std::exchange(other.in, -1);
+		out = std::exchange(other.out, -1);
 
-			return "";
+		input = std::move(other.input);
+		written = std::exchange(other.written, 0);
+
+		output = std::move(other.output);
+		rc = other.rc;
+
+		return *this;
+	}
+
+
+	Process::~Process() {
+		this->close();
+	}
+
+
+	// Closing our ends of the pipes makes a child that is still writing
+	// to us or reading from us give up, so waiting for it here is safe.
+	void Process::close() {
+		#if !defined(WPP_DISABLE_RUN)
+			for (int* fd: { &in, &out }) {
+				if (*fd != -1)
+					::close(*fd);
+
+				*fd = -1;
+			}
+
+			if (pid != -1) {
+				int status = 0;
+
+				while (waitpid(pid, &status, 0) == -1 and errno == EINTR)
+					;
+
+				pid = -1;
+			}
 		#endif
 	}
 
 
-	std::string exec(const std::string& cmd, const std::string& data, int& rc) {
+	// Start `cmd` with the shell and collect its standard output.
+	// If `input` is given it is written to the child's standard input and
+	// standard error is collected along with standard output, otherwise
+	// the child inherits our standard input and standard error.
+	// With `direct`, commands made of plain words are executed without
+	// going through the shell.
+	wpp::Process spawn(
+		const std::string& cmd,
+		const std::string* input,
+		bool direct,
+		const std::filesystem::path& dir
+	) {
+		wpp::Process proc;
+
 		#if !defined(WPP_DISABLE_RUN)
-			int stdin_pipe[2];
-			int stdout_pipe[2];
+			int in[2] = { -1, -1 };
+			int out[2] = { -1, -1 };
+
+			const auto close_all = [&] {
+				for (int fd: { in[0], in[1], out[0], out[1] })
+					if (fd != -1)
+						close(fd);
+			};
+
+			if ((input and not cloexec_pipe(in)) or not cloexec_pipe(out)) {
+				close_all();
+				return proc;
+			}
+
+			// Without addchdir only the shell can change directory for us.
+			#if defined(WPP_SPAWN_CHDIR)
+				const bool can_chdir = true;
+			#else
+				const bool can_chdir = dir.empty();
+			#endif
 
-			if (pipe(stdin_pipe) != 0 || pipe(stdout_pipe) != 0) {
-				rc = 1;
-				return "";
+			std::vector<std::string> args;
+
+			if (direct and can_chdir)
+				args = wpp::split_command(cmd);
+
+			const bool shell = args.empty();
+
+			if (shell)
+				args = { "sh", "-c", cmd };
+
+			if (not can_chdir) {
+				std::string quoted = "'";
+
+				for (const char c: dir.string())
+					quoted += c == '\'' ? std::string{"'\\''"} : std::string{c};
+
+				args.back() = "cd -- " + quoted + "' && " + cmd;
 			}
 
-			pid_t child = fork();
+			std::vector<char*> argv;
+
+			for (auto& arg: args)
+				argv.emplace_back(arg.data());
+
+			argv.emplace_back(nullptr);
+
+			// posix_spawn doesn't copy our address space like fork does, which
+			// gets expensive with a big tree and output buffer.
+			// dup2 clears close-on-exec on the copies so the originals go away
+			// by themselves. Ignored signals stay ignored across exec so
+			// SIGPIPE is restored in case a program embedding us ignores it.
+			posix_spawn_file_actions_t actions;
+			posix_spawn_file_actions_init(&actions);
 
-			std::string out;
+			if (input)
+				posix_spawn_file_actions_adddup2(&actions, in[0], STDIN_FILENO);
 
-			if (not child) {
-				dup2(stdin_pipe[0], STDIN_FILENO);
-				dup2(stdout_pipe[1], STDOUT_FILENO);
-				dup2(stdout_pipe[1], STDERR_FILENO);
+			posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
 
-				close(stdin_pipe[0]);
-				close(stdin_pipe[1]);
-				close(stdout_pipe[0]);
-				close(stdout_pipe[1]);
+			if (input)
+				posix_spawn_file_actions_adddup2(&actions, out[1], STDERR_FILENO);
 
-				execl("/bin/sh", "sh", "-c", cmd.c_str(), nullptr);
+			#if defined(WPP_SPAWN_CHDIR)
+				if (not dir.empty())
+					posix_spawn_file_actions_addchdir_np(&actions, dir.c_str());
+			#endif
+
+			posix_spawnattr_t attr;
+			posix_spawnattr_init(&attr);
+
+			sigset_t sigs;
+			sigemptyset(&sigs);
+			sigaddset(&sigs, SIGPIPE);
+
+			posix_spawnattr_setsigdefault(&attr, &sigs);
+			posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+
+			pid_t child = 0;
+
+			const int err = shell ?
+				posix_spawn(&child, "/bin/sh", &actions, &attr, argv.data(), environ):
+				posix_spawnp(&child, argv.front(), &actions, &attr, argv.data(), environ);
+
+			posix_spawn_file_actions_destroy(&actions);
+			posix_spawnattr_destroy(&attr);
+
+			// Like the shell, report a command that can't be found as 127.
+			if (err != 0) {
+				close_all();
+				proc.rc = 127;
+				return proc;
 			}
 
-			else {
-				close(stdout_pipe[1]);
-				close(stdin_pipe[0]);
+			// Close the ends that belong to the child.
+			close(out[1]);
+			proc.pid = child;
+			proc.out = out[0];
 
-				write(stdin_pipe[1], data.c_str(), data.size());
-				close(stdin_pipe[1]);
+			if (input) {
+				close(in[0]);
 
-				int wstatus;
-				wait(&wstatus);
+				fcntl(in[1], F_SETFL, fcntl(in[1], F_GETFL) | O_NONBLOCK);
 
-				rc = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : -1;
+				// Nothing to write so the child sees EOF straight away.
+				if (input->empty())
+					close(in[1]);
 
-				ssize_t n;
-				char buf[4096];
+				else {
+					proc.in = in[1];
+					proc.input = *input;
+				}
+			}
 
-				while ((n = read(stdout_pipe[0], buf, 4096)) > 0) {
-					out += std::string_view{buf, size_t(n)};
+		#else
+			(void)cmd;
+			(void)input;
+			(void)direct;
+			(void)dir;
+		#endif
+
+		return proc;
+	}
+
+
+	// Writing and reading are interleaved with poll so that a child which
+	// produces output before it has consumed all of its input can't
+	// deadlock against us.
+	void pump(const std::vector<wpp::Process*>& procs) {
+		#if !defined(WPP_DISABLE_RUN)
+			constexpr size_t chunk = 64 * 1024;
+			static thread_local char buf[chunk];
+
+			// Every process gets two entries, poll ignores the ones that are -1.
+			std::vector<pollfd> fds;
+
+			for (const wpp::Process* proc: procs) {
+				fds.push_back({ proc->out, POLLIN, 0 });
+				fds.push_back({ proc->in, POLLOUT, 0 });
+			}
+
+			while (poll(fds.data(), fds.size(), -1) == -1) {
+				if (errno != EINTR)
+					return;
+			}
+
+			for (size_t i = 0; i < procs.size(); ++i) {
+				auto& [pid, in, out, input, written, output, rc] = *procs[i];
+
+				if (fds[i * 2 + 1].revents) {
+					const ssize_t n = wpp::write_child(in, input.data() + written, std::min(input.size() - written, chunk));
+
+					if (n > 0)
+						written += n;
+
+					// Close stdin once everything has been written or the
+					// child has stopped reading.
+					if (written == input.size() or (n == -1 and errno != EAGAIN and errno != EINTR)) {
+						close(in);
+						in = -1;
+
+						input.clear();
+						input.shrink_to_fit();
+					}
 				}
 
-				close(stdout_pipe[0]);
+				if (fds[i * 2].revents) {
+					const ssize_t n = read(out, buf, chunk);
+
+					if (n > 0)
+						output.append(buf, n);
+
+					if (n == 0 or (n == -1 and errno != EAGAIN and errno != EINTR)) {
+						close(out);
+						out = -1;
+					}
+				}
+			}
+		#else
+			(void)procs;
+		#endif
+	}
+
+
+	void wait(wpp::Process& proc) {
+		#if !defined(WPP_DISABLE_RUN)
+			while (proc.running())
+				wpp::pump({ &proc });
+
+			if (proc.in != -1) {
+				close(proc.in);
+				proc.in = -1;
 			}
 
-			return out;
+			if (proc.pid == -1)
+				return;
+
+			int status = 0;
+
+			while (waitpid(proc.pid, &status, 0) == -1) {
+				if (errno != EINTR)
+					break;
+			}
+
+			proc.pid = -1;
+			proc.rc = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
 		#else
-			(void)cmd;
-			(void)data;
-			(void)rc;
-			return "";
+			(void)proc;
 		#endif
 	}
 
-	// Read a file into a string relatively quickly.
-	std::string read_file(std::string_view fname) {
-		auto filesize = std::filesystem::file_size(fname);
-		std::ifstream is(fname.data());
 
-		auto str = std::string(filesize + 1, '\0');
-		is.read(str.data(), static_cast<std::streamsize>(filesize));
+	// Execute a shell command, capture its standard output and return it.
+	std::string exec(const std::string& cmd, int& rc, bool direct, const std::filesystem::path& dir) {
+		auto proc = wpp::spawn(cmd, nullptr, direct, dir);
+		wpp::wait(proc);
 
-		return str;
+		rc = proc.rc;
+		return std::move(proc.output);
+	}
+
+
+	std::string exec(const std::string& cmd, const std::string& data, int& rc, bool direct, const std::filesystem::path& dir) {
+		auto proc = wpp::spawn(cmd, &data, direct, dir);
+		wpp::wait(proc);
+
+		rc = proc.rc;
+		return std::move(proc.output);
+	}
+
+
+	// Read a file into a string relatively quickly.
+	std::string read_file(std::string_view fname) {
+		return std::string{ wpp::Source::map(fname).view() };
 	}
 
 
@@ -144,5 +469,68 @@ namespace wpp {
 		file << contents;
 		file.close();
 	}
-}
 
+
+	// Escape the characters that make and ninja treat specially in paths.
+	// Backslashes are only special in front of the characters we escape
+	// and in front of the space that ends the path, so only those runs
+	// of them are doubled. Everywhere else they are left alone.
+	std::string make_escape(std::string_view path) {
+		constexpr std::string_view special = " #:";
+		std::string str;
+
+		for (size_t i = 0; i < path.size(); ++i) {
+			const char c = path[i];
+
+			if (c == '\\') {
+				const size_t end = std::min(path.find_first_not_of('\\', i), path.size());
+				const size_t n = end - i;
+
+				const bool doubled = end == path.size() or special.find(path[end]) != std::string_view::npos;
+				str.append(doubled ? n * 2 : n, '\\');
+
+				i = end - 1;
+				continue;
+			}
+
+			if (c == '$')
+				str += '$';
+
+			else if (special.find(c) != std::string_view::npos)
+				str += '\\';
+
+			str += c;
+		}
+
+		return str;
+	}
+
+
+	void write_depfile(
+		std::string_view fname,
+		std::string_view target,
+		const std::vector<std::filesystem::path>& deps,
+		const std::filesystem::path& base
+	) {
+		std::string str = wpp::make_escape(target) + ":";
+		std::unordered_set<std::string> seen;
+
+		for (const auto& dep: deps) {
+			auto path = dep.lexically_relative(base);
+
+			if (path.empty())
+				path = dep;
+
+			auto name = wpp::make_escape(path.generic_string());
+
+			if (not seen.insert(name).second)
+				continue;
+
+			str += " \\\n  " + name;
+		}
+
+		str += "\n";
+
+		wpp::write_file(fname, str);
+	}
+}
@@ -8,6 +8,8 @@
 #include <string>
 #include <sstream>
 #include <variant>
+#include <vector>
+#include <filesystem>
 
 #include <frontend/position.hpp>
 
@@ -56,20 +58,36 @@ namespace wpp {
 	}
 
 
+	// Print a diagnostic with position info to `os`. The message is
+	// formatted first and written in one go so that diagnostics from
+	// environments on different threads don't get mixed together.
+	template <typename... Ts>
+	inline void diagnostic(std::ostream& os, const char* kind, const wpp::Position& pos, Ts&&... args) {
+		std::ostringstream ss;
+		((ss << kind << " @ " << pos << ": ") << ... << std::forward<Ts>(args)) << '\n';
+		os << ss.str();
+	}
+
 	// Print an error with position info.
+	template <typename... Ts>
+	inline void error(std::ostream& os, const wpp::Position& pos, Ts&&... args) {
+		wpp::diagnostic(os, "error", pos, std::forward<Ts>(args)...);
+	}
+
 	template <typename... Ts>
 	inline void error(const wpp::Position& pos, Ts&&... args) {
-		([&] () -> std::ostream& {
-			return (std::cerr << "error @ " << pos << ": ");
-		} () << ... << std::forward<Ts>(args)) << '\n';
+		wpp::error(std::cerr, pos, std::forward<Ts>(args)...);
 	}
 
 	// Print a warning with position info.
+	template <typename... Ts>
+	inline void warn(std::ostream& os, const wpp::Position& pos, Ts&&... args) {
+		wpp::diagnostic(os, "warning", pos, std::forward<Ts>(args)...);
+	}
+
 	template <typename... Ts>
 	inline void warn(const wpp::Position& pos, Ts&&... args) {
-		([&] () -> std::ostream& {
-			return (std::cerr << "warning @ " << pos << ": ");
-		} () << ... << std::forward<Ts>(args)) << '\n';
+		wpp::warn(std::cerr, pos, std::forward<Ts>(args)...);
 	}
 
 
@@ -90,19 +108,74 @@ namespace wpp {
 	uint64_t hash_bytes(const char*, const char* const);
 
 
-	// Execute a shell command, capture its standard output and return it
-	// https://stackoverflow.com/questions/478898/how-do-i-execute-a-command-and-get-the-output-of-the-command-within-c-using-po
-	std::string exec(const std::string&, int&);
+	// A child process started by `spawn`. `pump` writes its input and
+	// collects its output until it closes its end, `wait` reaps it.
+	struct Process {
+		int pid = -1;
+		int in = -1, out = -1;
+
+		std::string input{};
+		size_t written = 0;
+
+		std::string output{};
+		int rc = -1;  // Exit status once reaped, -1 if it couldn't be run.
+
+		Process() = default;
 
+		Process(Process&&) noexcept;
+		Process& operator=(Process&&) noexcept;
+		~Process();
 
-	// Pipe string to stdin of a cmd.
-	std::string exec(const std::string&, const std::string&, int&);
+		// Whether there is still output to collect.
+		bool running() const { return out != -1; }
 
+		private:
+			void close();
+	};
 
-	// Read a file into a string relatively quickly.
+
+	// Start a command, see `exec` below for what the arguments mean.
+	wpp::Process spawn(
+		const std::string& cmd,
+		const std::string* input,
+		bool direct,
+		const std::filesystem::path& dir = {}
+	);
+
+	// Move data to and from the given processes, blocking until at least
+	// one of them is ready.
+	void pump(const std::vector<wpp::Process*>& procs);
+
+	// Collect the rest of the output of a process and wait for it to exit.
+	void wait(wpp::Process& proc);
+
+
+	// Execute a shell command, capture its standard output and return it.
+	// `rc` is set to the exit status or -1 if the command couldn't be run.
+	// With `direct`, commands without any shell syntax are executed
+	// without starting a shell. The command runs in `dir` if one is given.
+	std::string exec(const std::string&, int&, bool direct = false, const std::filesystem::path& dir = {});
+
+
+	// Pipe string to stdin of a cmd and capture its standard output and error.
+	std::string exec(const std::string&, const std::string&, int&, bool direct = false, const std::filesystem::path& dir = {});
+
+
+	// Read a file into a string. Source files should be mapped with
+	// `wpp::Source::map` instead to avoid the copy.
 	std::string read_file(std::string_view);
 
 	void write_file(std::string_view, const std::string&);
+
+
+	// Write a Makefile style rule saying that `target` depends on `deps`.
+	// Paths are written relative to `base` and each one only once.
+	void write_depfile(
+		std::string_view fname,
+		std::string_view target,
+		const std::vector<std::filesystem::path>& deps,
+		const std::filesystem::path& base
+	);
 }
 
 
@@ -0,0 +1,148 @@
+#pragma once
+
+#ifndef WOTPP_FN_TABLE
+#define WOTPP_FN_TABLE
+
+#include <vector>
+#include <memory>
+#include <utility>
+
+#include <cstdint>
+#include <cstddef>
+
+#include <structures/symbol.hpp>
+#include <frontend/ast.hpp>
+
+// Function table.
+// Maps a (symbol, arity) pair to a stack of definitions using a flat
+// open-addressing table with linear probing. Entries are never removed,
+// dropping the last definition of a function just leaves its stack empty.
+// A table can sit on top of a frozen parent table which is shared with
+// other tables. Lookups fall through to the parent and a stack is copied
+// out of it the first time it is modified.
+
+namespace wpp {
+	class FnTable {
+		using key_t = uint64_t;
+		static constexpr key_t KEY_EMPTY = ~key_t{0};
+
+		struct Slot {
+			key_t key = KEY_EMPTY;
+			std::vector<wpp::node_t> defs{};
+		};
+
+		std::vector<Slot> slots = std::vector<Slot>(16);
+		size_t used = 0;
+
+		std::shared_ptr<const FnTable> parent{};
+
+
+		static constexpr key_t make_key(wpp::symbol_t sym, size_t arity) {
+			return (static_cast<key_t>(sym) << 32) | static_cast<uint32_t>(arity);
+		}
+
+		// Fibonacci hashing, the mask picks bits from the well mixed top half.
+		size_t index(key_t key) const {
+			return ((key * 0x9E3779B97F4A7C15ull) >> 32) & (slots.size() - 1);
+		}
+
+		// Find the slot for a key or the empty slot where it would go.
+		size_t probe(key_t key) const {
+			size_t i = index(key);
+
+			while (slots[i].key != key and slots[i].key != KEY_EMPTY)
+				i = (i + 1) & (slots.size() - 1);
+
+			return i;
+		}
+
+		const std::vector<wpp::node_t>* lookup(key_t key) const {
+			for (const FnTable* table = this; table; table = table->parent.get()) {
+				const Slot& slot = table->slots[table->probe(key)];
+
+				if (slot.key != KEY_EMPTY)
+					return &slot.defs;
+			}
+
+			return nullptr;
+		}
+
+		void grow() {
+			std::vector<Slot> old = std::exchange(slots, std::vector<Slot>(slots.size() * 2));
+
+			for (Slot& slot: old) {
+				if (slot.key != KEY_EMPTY)
+					slots[probe(slot.key)] = std::move(slot);
+			}
+		}
+
+
+		public:
+			FnTable() = default;
+
+			// Start a table on top of a frozen one.
+			FnTable(std::shared_ptr<const FnTable> parent_):
+				parent(std::move(parent_)) {}
+
+
+			// Move our definitions into a new frozen table that becomes our
+			// parent and return it so that other tables can be started on top of it.
+			std::shared_ptr<const FnTable> freeze() {
+				if (used == 0 and parent)
+					return parent;
+
+				auto frozen = std::make_shared<const FnTable>(std::move(*this));
+				*this = FnTable{ frozen };
+
+				return frozen;
+			}
+
+
+			// Get the definitions of a function or nullptr if it was never defined.
+			const std::vector<wpp::node_t>* find(wpp::symbol_t sym, size_t arity) const {
+				return lookup(make_key(sym, arity));
+			}
+
+			// Get the definitions of a function, creating an entry if needed.
+			std::vector<wpp::node_t>& operator()(wpp::symbol_t sym, size_t arity) {
+				// Keep the load factor under 1/2 so probe sequences stay short.
+				if ((used + 1) * 2 > slots.size())
+					grow();
+
+				const key_t key = make_key(sym, arity);
+				Slot& slot = slots[probe(key)];
+
+				if (slot.key == KEY_EMPTY) {
+					slot.key = key;
+					used++;
+
+					// Copy the definitions we are about to change out of our parent.
+					if (const auto* defs = parent ? parent->lookup(key) : nullptr)
+						slot.defs = *defs;
+				}
+
+				return slot.defs;
+			}
+
+			// Check if a function currently has a definition.
+			bool defined(wpp::symbol_t sym, size_t arity) const {
+				const auto* defs = find(sym, arity);
+				return defs and not defs->empty();
+			}
+
+			// Call `f(sym, arity, defs)` for every function, including the
+			// ones only our parents have. Stacks we copied out of a parent
+			// are only visited once.
+			template <typename F>
+			void each(F&& f) const {
+				for (const FnTable* table = this; table; table = table->parent.get()) {
+					for (const Slot& slot: table->slots) {
+						if (slot.key != KEY_EMPTY and lookup(slot.key) == &slot.defs)
+							f(static_cast<wpp::symbol_t>(slot.key >> 32), static_cast<size_t>(slot.key & 0xFFFFFFFF), slot.defs);
+					}
+				}
+			}
+	};
+}
+
+#endif
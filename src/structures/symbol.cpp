@@ -0,0 +1,36 @@
+#include <string>
+#include <string_view>
+#include <deque>
+#include <unordered_map>
+#include <mutex>
+
+#include <structures/symbol.hpp>
+
+
+namespace wpp {
+	// Names live in a deque so that the views used as keys and references
+	// handed out by `symbol_str` stay valid when new names are added.
+	std::deque<std::string> symbol_names;
+	std::unordered_map<std::string_view, wpp::symbol_t> symbols;
+	std::mutex symbols_mutex;
+
+
+	wpp::symbol_t intern(std::string_view name) {
+		std::lock_guard lock{symbols_mutex};
+
+		if (auto it = symbols.find(name); it != symbols.end())
+			return it->second;
+
+		const wpp::symbol_t sym = symbol_names.size();
+		const std::string& str = symbol_names.emplace_back(name);
+
+		symbols.emplace(str, sym);
+		return sym;
+	}
+
+
+	const std::string& symbol_str(wpp::symbol_t sym) {
+		std::lock_guard lock{symbols_mutex};
+		return symbol_names[sym];
+	}
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#ifndef WOTPP_SYMBOL
+#define WOTPP_SYMBOL
+
+#include <string>
+#include <string_view>
+
+#include <cstdint>
+
+// Interned identifiers.
+// Every distinct name is stored once and referred to by an integer ID so
+// that names can be compared and hashed without touching the string.
+
+namespace wpp {
+	using symbol_t = uint32_t;
+
+	// Get the ID of a name, adding it to the table if we haven't seen it before.
+	wpp::symbol_t intern(std::string_view name);
+
+	// Get the name of a symbol. The reference stays valid for the rest of the program.
+	const std::string& symbol_str(wpp::symbol_t sym);
+}
+
+#endif
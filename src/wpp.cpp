@@ -0,0 +1,214 @@
+#include <string>
+#include <string_view>
+#include <vector>
+#include <utility>
+#include <memory>
+#include <filesystem>
+
+#include <frontend/position.hpp>
+#include <frontend/lexer/lexer.hpp>
+#include <frontend/parser/parser.hpp>
+#include <structures/exception.hpp>
+#include <backend/eval/eval.hpp>
+#include <backend/vm/vm.hpp>
+#include <backend/image/image.hpp>
+
+#include <wpp.hpp>
+
+
+namespace wpp {
+	namespace {
+		wpp::RenderError render_error(const wpp::Exception& e) {
+			const auto& [path, line, column, eof] = wpp::resolve(e.pos);
+			return { e.what(), path, line, column, eof };
+		}
+	}
+
+
+	struct Context::State {
+		wpp::Options options;
+		wpp::AST tree;
+		wpp::Environment env;
+		wpp::VM machine;
+
+		// The last snapshot taken by `freeze`.
+		std::shared_ptr<const wpp::Snapshot> frozen{};
+
+		State(const std::filesystem::path& dir, const wpp::Options& options_):
+			options(options_),
+			tree(),
+			env(dir, tree),
+			machine(env)
+		{
+			configure();
+		}
+
+		State(const std::shared_ptr<const wpp::Snapshot>& snapshot, const wpp::Options& options_):
+			options(options_),
+			tree(),
+			env(snapshot, tree),
+			machine(env),
+			frozen(snapshot)
+		{
+			configure();
+		}
+
+		void configure() {
+			env.warning_flags = options.warnings;
+			env.diagnostics = options.diagnostics;
+			env.commands = { options.direct_exec, options.run_cache, options.run_cache_salt };
+			env.jobs.limit = options.jobs;
+			env.sources.once = options.source_once;
+
+			tree.reserve((1024 * 1024 * 10) / sizeof(decltype(tree)::value_type));
+		}
+
+		// Parse and evaluate a file from the file table.
+		void evaluate(wpp::file_id_t file, std::string& out, const Context::Flush& flush) {
+			// Code that doesn't define anything is freed afterwards so that
+			// a long lived context doesn't keep growing.
+			const wpp::Region region = machine.region();
+
+			const auto run = [&] (wpp::node_t node) {
+				try {
+					if (options.vm)
+						out += machine.run(node);
+
+					else
+						wpp::eval_ast(node, env, out);
+				}
+
+				// Commands still running in the background were called before
+				// whatever went wrong, so their errors come first.
+				catch (const wpp::Exception&) {
+					wpp::settle(env);
+					throw;
+				}
+			};
+
+			const auto reclaim = [&] {
+				env.jobs.sink = nullptr;
+
+				if (options.vm)
+					machine.reclaim(region);
+
+				else
+					wpp::reclaim(region.nodes, env);
+
+				// If every node was freed then nothing refers to the source
+				// either, errors have already been resolved by now.
+				if (tree.mark() == region.nodes)
+					wpp::release_file(file);
+			};
+
+			env.jobs.sink = &out;
+
+			try {
+				wpp::Lexer lex{file};
+				const wpp::node_t root = wpp::document(lex, tree);
+
+				if (flush) {
+					// Copy the statements because evaluating them can add to the tree.
+					const auto stmts = tree.get<wpp::Document>(root).stmts;
+
+					for (const wpp::node_t stmt: stmts) {
+						run(stmt);
+						wpp::settle(env);
+						flush(out);
+					}
+				}
+
+				else
+					run(root);
+
+				wpp::settle(env);
+			}
+
+			catch (const wpp::Exception& e) {
+				const auto err = render_error(e);
+				reclaim();
+				throw err;
+			}
+
+			reclaim();
+		}
+	};
+
+
+	Context::Context(const std::filesystem::path& dir, const wpp::Options& options):
+		state(std::make_unique<State>(dir, options)) {}
+
+	Context::Context(Context&&) noexcept = default;
+	Context& Context::operator=(Context&&) noexcept = default;
+	Context::~Context() = default;
+
+
+	void Context::render(std::string_view code, std::string& out, const std::string& name) {
+		state->evaluate(wpp::add_file(name, wpp::Source{ std::string{code} }), out, {});
+	}
+
+
+	void Context::render_file(const std::filesystem::path& path, std::string& out, const Flush& flush) {
+		auto& env = state->env;
+
+		const auto full = (env.base / path).lexically_normal();
+		wpp::Source file = wpp::Source::map(full.string());
+
+		env.inputs.emplace_back(full);
+
+		const auto file_id = wpp::add_file(std::filesystem::relative(full, env.base).string(), std::move(file));
+		const auto old_path = env.cwd;
+
+		env.cwd = full.parent_path();
+
+		try {
+			state->evaluate(file_id, out, flush);
+		}
+
+		catch (const wpp::RenderError&) {
+			env.cwd = old_path;
+			throw;
+		}
+
+		env.cwd = old_path;
+	}
+
+
+	void Context::freeze() {
+		state->frozen = state->env.snapshot();
+	}
+
+
+	Context::Context(std::unique_ptr<State> state_):
+		state(std::move(state_)) {}
+
+
+	Context Context::fork(const wpp::Options& options) const {
+		if (not state->frozen)
+			return Context{ state->env.base, options };
+
+		return Context{ std::make_unique<State>(state->frozen, options) };
+	}
+
+
+	void Context::dump_image(const std::filesystem::path& path) {
+		freeze();
+		wpp::dump_image(*state->frozen, path);
+	}
+
+
+	Context Context::from_image(const std::filesystem::path& path, const std::filesystem::path& dir, const wpp::Options& options) {
+		return Context{ std::make_unique<State>(wpp::load_image(path, dir), options) };
+	}
+
+
+	void Context::load(const std::filesystem::path& path) {
+		std::string out;
+		render_file(path, out);
+	}
+
+
+	const std::vector<std::filesystem::path>& Context::inputs() const {
+		return state->env.inputs;
+	}
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#ifndef WOTPP_WPP
+#define WOTPP_WPP
+
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <filesystem>
+#include <stdexcept>
+
+#include <cstddef>
+
+#include <misc/warnings.hpp>
+
+// Public interface of libwpp for programs which embed wot++.
+// Nothing else under src/ is part of the interface, only this header
+// and misc/warnings.hpp are installed.
+
+namespace wpp {
+	struct Options {
+		bool vm = false;  // Use the bytecode VM instead of the tree walker.
+		wpp::warning_t warnings = 0;
+
+		bool direct_exec = false;  // Run commands without the shell where possible.
+		size_t jobs = 1;  // Number of run and pipe calls that may be in flight at once.
+
+		std::filesystem::path run_cache{};  // Absolute directory of cached run results, empty to disable.
+		std::string run_cache_salt{};
+
+		bool source_once = false;  // Skip files that have already been sourced.
+
+		// Where warnings and the output of `log` are written.
+		std::ostream* diagnostics = &std::cerr;
+	};
+
+
+	// Thrown when rendering fails. The position is resolved before it is
+	// thrown so it doesn't refer to anything inside of the context.
+	struct RenderError: public std::runtime_error {
+		std::string path;
+		int line = 1, column = 1;
+		bool eof = false;
+
+		RenderError(const std::string& msg, const std::string& path_, int line_, int column_, bool eof_):
+			std::runtime_error(msg),
+			path(path_),
+			line(line_),
+			column(column_),
+			eof(eof_) {}
+	};
+
+	// Formatted the same way as the errors printed by w++.
+	inline std::ostream& operator<<(std::ostream& os, const RenderError& e) {
+		os << "error @ " << e.path << ':';
+
+		if (e.eof)
+			os << "EOF";
+
+		else
+			os << e.line << ':' << e.column;
+
+		return (os << ": " << e.what());
+	}
+
+
+	// An environment that code is rendered in. Functions defined by one
+	// render are still defined in the next so a prelude only has to be
+	// loaded once. Contexts don't share anything so each thread can have
+	// its own, but a single context must only be used by one thread at a time.
+	class Context {
+		struct State;
+		std::unique_ptr<State> state;
+
+		Context(std::unique_ptr<State> state_);
+
+		public:
+			// Called after every top-level statement of a file with the output
+			// so far. The callback can write it out and clear it.
+			using Flush = std::function<void(std::string&)>;
+
+			// Relative paths are resolved against `dir`.
+			Context(const std::filesystem::path& dir, const wpp::Options& options = {});
+
+			Context(Context&&) noexcept;
+			Context& operator=(Context&&) noexcept;
+			~Context();
+
+			// Render code and append the output to `out`.
+			// `name` is the path used in errors and warnings.
+			// Throws wpp::RenderError.
+			void render(std::string_view code, std::string& out, const std::string& name = "<string>");
+
+			// Render a file and append the output to `out`. Paths used by the
+			// file are resolved against its own directory.
+			// Throws wpp::RenderError, or std::filesystem::filesystem_error if
+			// the file can't be read.
+			void render_file(const std::filesystem::path& path, std::string& out, const Flush& flush = {});
+
+			// Render a file for the functions it defines and drop its output.
+			void load(const std::filesystem::path& path);
+
+			// Freeze everything defined so far, e.g. after loading a prelude.
+			// Forks share what was frozen instead of copying it.
+			void freeze();
+
+			// A new context on top of what was defined when `freeze` was last
+			// called. Nothing defined in a fork is seen by this context or by
+			// other forks. Once frozen, forks can be made from several threads.
+			Context fork(const wpp::Options& options = {}) const;
+
+			// Freeze the context and write everything it has defined to an
+			// image that `from_image` can start a context from much faster
+			// than loading the same files again.
+			// Throws std::filesystem::filesystem_error if it can't be written.
+			void dump_image(const std::filesystem::path& path);
+
+			// A frozen context holding what was in an image. Relative paths
+			// are resolved against `dir`. The image stays mapped for the rest
+			// of the program.
+			// Throws std::filesystem::filesystem_error if it can't be read or
+			// std::runtime_error if it is damaged or from another version.
+			static Context from_image(const std::filesystem::path& path, const std::filesystem::path& dir, const wpp::Options& options = {});
+
+			// Absolute paths of every file read so far.
+			const std::vector<std::filesystem::path>& inputs() const;
+	};
+}
+
+#endif
@@ -26,12 +26,41 @@ def run(args):
 
 
 if __name__ == "__main__":
-	if len(sys.argv) != 3:
-		print("usage: <w++ exe> <test.wpp>")
+	if len(sys.argv) < 3:
+		print("usage: <w++ exe> <test.wpp> [flags...]")
 		sys.exit(1)
 
-	# Unpack argv
-	_, binary, test_file = sys.argv
+	# Unpack argv, any trailing arguments are passed through to w++.
+	_, binary, test_file, *flags = sys.argv
+
+	# Options for us rather than w++:
+	#   --expect-file=PATH    compare against PATH, written by w++, instead of stdout.
+	#   --expect-absent=PATH  PATH must not exist once w++ has finished.
+	#   --expect-failure      w++ must exit with non-zero status, only --expect-file
+	#                         and --expect-absent are checked.
+	expect_file = None
+	expect_absent = []
+	expect_failure = False
+
+	wpp_flags = []
+
+	for flag in flags:
+		if flag.startswith("--expect-file="):
+			expect_file = flag.split("=", 1)[1]
+
+		elif flag.startswith("--expect-absent="):
+			expect_absent.append(flag.split("=", 1)[1])
+
+		elif flag == "--expect-failure":
+			expect_failure = True
+
+		else:
+			wpp_flags.append(flag)
+
+	# Files left behind by an earlier run mustn't make us pass.
+	for path in [expect_file, *expect_absent]:
+		if path is not None and os.path.exists(path):
+			os.remove(path)
 
 	# Ensure were running the w++ executable in the current directory
 	binary = f"./{binary}"
@@ -40,14 +69,37 @@ if __name__ == "__main__":
 	wpp_output = ""
 
 	try:
-		wpp_output = run([binary, test_file])
-		if len(wpp_output) > 0:
-			if wpp_output[-1] == '\n':
-				wpp_output = wpp_output[:-1]
+		wpp_output = run([binary, test_file, *wpp_flags])
+
+		if expect_failure:
+			print("w++ succeeded but was expected to fail")
+			sys.exit(1)
 
 	except RuntimeError as err:
-		print(f"w++ failed: {err.args[0]}")
-		sys.exit(1)
+		if not expect_failure:
+			print(f"w++ failed: {err.args[0]}")
+			sys.exit(1)
+
+	for path in expect_absent:
+		if os.path.exists(path):
+			print(f"'{path}' was written")
+			sys.exit(1)
+
+	# A failure is only checked for what it left behind.
+	if expect_failure and expect_file is None:
+		sys.exit(0)
+
+	if expect_file is not None:
+		if not os.path.exists(expect_file):
+			print(f"'{expect_file}' was not written")
+			sys.exit(1)
+
+		with open(expect_file, 'r') as f:
+			wpp_output = f.read()
+
+	if len(wpp_output) > 0:
+		if wpp_output[-1] == '\n':
+			wpp_output = wpp_output[:-1]
 
 	# Find all test cases of the form `#[expect(foo)]`
 	matches = []